@@ -0,0 +1,86 @@
+/*!
+ * \file engine_bench.cpp
+ *
+ * \brief 比較buddy和tlsf兩種塊引擎的分配延遲和內部碎片
+ * \date 2026-10-17
+ */
+
+#include <cstdio>
+#include <random>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <spdlog/spdlog.h>
+#include <utility>
+#include <vector>
+
+#include "../src/latency_histogram.hpp"
+#include "../src/pool.hpp"
+
+namespace {
+  auto logger = spdlog::stdout_color_mt("cuda_buddy");
+
+  constexpr size_t op_num = 200000;
+  constexpr size_t max_live_num = 2000;
+
+  //! 三分之二的請求在16K以內，其餘在1M以內，隨機釋放
+  void run(cuda_buddy::block_engine engine) {
+    cuda_buddy::pool::release_global_pool(-1);
+    cuda_buddy::pool buddy_pool(-1, engine);
+    std::mt19937 rng(42);
+    std::vector<std::pair<void *, size_t>> live;
+    size_t requested = 0;
+    size_t failure_num = 0;
+    double waste = 0;
+    size_t sample_num = 0;
+
+    cuda_buddy::latency_histogram::reset();
+    cuda_buddy::latency_histogram::enable();
+    for (size_t i = 0; i < op_num; i++) {
+      auto size = (rng() % 3 == 0) ? rng() % (1 << 20) + 1 : rng() % 16384 + 1;
+      if (auto ptr = buddy_pool.alloc(size)) {
+        live.emplace_back(ptr, size);
+        requested += size;
+      } else {
+        failure_num++;
+      }
+      if (live.size() > max_live_num || (rng() % 3 == 0 && !live.empty())) {
+        auto k = rng() % live.size();
+        buddy_pool.free(live[k].first);
+        requested -= live[k].second;
+        live[k] = live.back();
+        live.pop_back();
+      }
+      if (i % 1000 == 999 && buddy_pool.used_bytes() != 0) {
+        waste += 1 - static_cast<double>(requested) / buddy_pool.used_bytes();
+        sample_num++;
+      }
+    }
+    cuda_buddy::latency_histogram::disable();
+    for (auto const &[ptr, size] : live) {
+      buddy_pool.free(ptr);
+    }
+
+    auto alloc_stat = cuda_buddy::latency_histogram::get(
+        cuda_buddy::latency_histogram::operation::pool_alloc);
+    auto free_stat = cuda_buddy::latency_histogram::get(
+        cuda_buddy::latency_histogram::operation::pool_free);
+    std::printf("%-5s alloc mean %6.0f ns p50 %6lu p99 %6lu | free mean %6.0f "
+                "ns p99 %6lu | failures %5zu | internal waste %4.1f%%\n",
+                engine == cuda_buddy::block_engine::tlsf ? "tlsf" : "buddy",
+                alloc_stat.mean_ns(),
+                static_cast<unsigned long>(alloc_stat.value_at_percentile(50)),
+                static_cast<unsigned long>(alloc_stat.value_at_percentile(99)),
+                free_stat.mean_ns(),
+                static_cast<unsigned long>(free_stat.value_at_percentile(99)),
+                failure_num, sample_num ? 100 * waste / sample_num : 0.0);
+  }
+} // namespace
+
+int main() {
+  cuda_buddy::pool::set_host_pool_size(cuda_buddy::pool::buddy_block_level +
+                                       3);
+  for (int round = 0; round < 2; round++) {
+    run(cuda_buddy::block_engine::buddy);
+    run(cuda_buddy::block_engine::tlsf);
+  }
+  return 0;
+}
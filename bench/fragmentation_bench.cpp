@@ -0,0 +1,76 @@
+/*!
+ * \file fragmentation_bench.cpp
+ *
+ * \brief 比較first_fit和best_fit在混合大小負載下的碎片和速度
+ * \date 2026-10-17
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <spdlog/spdlog.h>
+#include <vector>
+
+#include "../src/allocator.hpp"
+
+namespace {
+  auto logger = spdlog::stdout_color_mt("cuda_buddy");
+
+  constexpr size_t op_num = 300000;
+  constexpr size_t max_live_num = 20000;
+
+  //! 16MB的塊，1B到4KB的請求中夾雜2%的32KB到512KB，約60%是分配
+  void run(cuda_buddy::fit_policy policy) {
+    cuda_buddy::allocator buddy_allocator(24, cuda_buddy::alloc_location::host);
+    buddy_allocator.set_fit_policy(policy);
+    std::mt19937 rng(7);
+    std::vector<void *> live;
+    double largest_ratio = 0;
+    size_t sample_num = 0;
+    size_t failure_num = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < op_num; i++) {
+      size_t size = 1ULL << (rng() % 13);
+      if (rng() % 50 == 0) {
+        size = 1ULL << (15 + rng() % 5);
+      }
+      if (live.size() < max_live_num && rng() % 5 < 3) {
+        if (auto ptr = buddy_allocator.alloc(size)) {
+          live.push_back(ptr);
+        } else {
+          failure_num++;
+        }
+      } else if (!live.empty()) {
+        auto k = rng() % live.size();
+        buddy_allocator.free(live[k]);
+        live[k] = live.back();
+        live.pop_back();
+      }
+      if (i % 1000 == 0) {
+        largest_ratio += static_cast<double>(buddy_allocator.largest_free()) /
+                         buddy_allocator.free_bytes();
+        sample_num++;
+      }
+    }
+    auto ns_per_op = std::chrono::duration<double, std::nano>(
+                         std::chrono::steady_clock::now() - start)
+                         .count() /
+                     op_num;
+    for (auto ptr : live) {
+      buddy_allocator.free(ptr);
+    }
+    std::printf("%-9s largest_free/free_bytes %.3f | failures %5zu | %6.0f "
+                "ns/op\n",
+                policy == cuda_buddy::fit_policy::best_fit ? "best_fit"
+                                                           : "first_fit",
+                largest_ratio / sample_num, failure_num, ns_per_op);
+  }
+} // namespace
+
+int main() {
+  run(cuda_buddy::fit_policy::first_fit);
+  run(cuda_buddy::fit_policy::best_fit);
+  return 0;
+}
@@ -6,13 +6,18 @@
  * \date 2017-11-27
  */
 
+#include <algorithm>
+#include <bit>
 #include <cassert>
 #include <cstdlib>
+#include <functional>
 #include <cuda_runtime.h>
 #include <spdlog/spdlog.h>
 #include <stdexcept>
 #include <string>
 #include <system_error>
+#include <thread>
+#include <vector>
 
 #if defined(__linux__)
 #include <linux/mman.h>
@@ -20,6 +25,9 @@
 #endif
 
 #include "allocator.hpp"
+#include "cuda_check.hpp"
+#include "latency_histogram.hpp"
+#include "probe.hpp"
 
 namespace cuda_buddy {
 
@@ -35,6 +43,7 @@ namespace cuda_buddy {
       x |= x >> 4u;
       x |= x >> 8u;
       x |= x >> 16u;
+      x |= x >> 32u;
       return x + 1;
     }
 
@@ -42,29 +51,34 @@ namespace cuda_buddy {
                                        uint8_t max_level) {
       return ((index + 1) - (1ULL << level)) << (max_level - level);
     }
-  } // namespace
 
-  // CUDA: various checks for different function calls.
-  static inline void cuda_check(cudaError_t error, const std::string &operation,
-                                bool do_abort) {
-    if (error != cudaSuccess && error != cudaErrorCudartUnloading) {
-      std::string err_str(operation + " failed:");
-      err_str += cudaGetErrorString(error);
-      if (do_abort) {
-        spdlog::error("{}", err_str);
-        abort();
-      } else {
-        throw std::runtime_error(err_str);
+    //! 獨佔鎖內修改樹的範圍，析構時遞增版本號
+    class version_guard final {
+    public:
+      explicit version_guard(std::atomic<uint64_t> &version_)
+          : version(version_) {}
+      version_guard(const version_guard &) = delete;
+      version_guard &operator=(const version_guard &) = delete;
+      ~version_guard() {
+        version.store(version.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_release);
       }
-    }
-  }
 
-  allocator::allocator(uint8_t max_level_, alloc_location data_location_)
-      : max_level(max_level_), tree(nullptr), data(nullptr),
-        data_location(data_location_) {
+    private:
+      std::atomic<uint64_t> &version;
+    };
+  } // namespace
+
+  allocator::allocator(uint8_t max_level_, alloc_location data_location_,
+                       uint32_t id_)
+      : used_size(own_state.used_size),
+        free_node_num(own_state.free_node_num), max_level(max_level_),
+        tree(nullptr), data(nullptr), data_location(data_location_),
+        block_id(id_) {
 
     assert(max_level <= 32);
     size_t size = 1ULL << max_level;
+    free_node_num[0] = 1;
 
 #if defined(__linux__)
     // MAP_ANONYMOUS will do zero initialization
@@ -88,7 +102,28 @@ namespace cuda_buddy {
     }
   }
 
+  allocator::allocator(uint8_t max_level_, uint8_t *tree_, void *data_,
+                       shared_state &state, uint32_t id_)
+      : used_size(state.used_size), free_node_num(state.free_node_num),
+        max_level(max_level_), tree(tree_), data(data_),
+        alloc_mutex(&state.mutex), data_location(alloc_location::host),
+        block_id(id_), external_memory(true) {
+    assert(max_level <= 32);
+    //持有鎖的進程死掉時統計可能只更新了一半，從樹重新計算
+    alloc_mutex.native().set_recovery([this]() { rebuild_summary(); });
+  }
+
+  void allocator::init_shared_state(shared_state &state) {
+    allocator_mutex::init_process_mutex(&state.mutex);
+    state.used_size = 0;
+    state.free_node_num.fill(0);
+    state.free_node_num[0] = 1;
+  }
+
   allocator::~allocator() {
+    if (external_memory) {
+      return;
+    }
 
 #if defined(__linux__)
     size_t size = 1ULL << max_level;
@@ -124,9 +159,7 @@ namespace cuda_buddy {
     }
   }
 
-  void *allocator::alloc(size_t size, size_t alignment) {
-    std::lock_guard lk(alloc_mutex);
-
+  size_t allocator::node_size(size_t size, size_t alignment) {
     if (size == 0) {
       size = 1;
     }
@@ -134,40 +167,227 @@ namespace cuda_buddy {
     if (alignment > 1) {
       size += alignment - 1;
     }
-    size = next_pow_of_2(size);
-    //我们目前的参数类型决定了只能分配这么多
-    if (size > static_cast<size_t>(UINT32_MAX)) {
-      spdlog::warn("too large size {}", size);
+    return next_pow_of_2(size);
+  }
+
+  size_t allocator::largest_free() const {
+    std::shared_lock lk(alloc_mutex);
+    if (tlsf_engine) {
+      return tlsf_engine->largest_free();
+    }
+    auto top_level = stripe_level.load(std::memory_order_relaxed);
+    if (top_level != 0) {
+      //條帶之上的節點總是切分的，空閒的條帶可以合併成更大的節點
+      if (auto level = merged_free_level(0, 0); level <= top_level) {
+        return 1ULL << (max_level - level);
+      }
+      top_level++;
+    } else if (keeps_unmerged()) {
+      //延遲和保留的兄弟在分配失敗時會合併
+      auto level = merged_free_level(0, 0);
+      return level == index_none ? 0 : 1ULL << (max_level - level);
+    }
+    for (uint8_t level = top_level; level <= max_level; level++) {
+      if (load_count(free_node_num[level]) != 0) {
+        return 1ULL << (max_level - level);
+      }
+    }
+    return 0;
+  }
+
+  void *allocator::alloc(size_t size, size_t alignment) {
+    size_t alloced_size = 0;
+    return alloc(size, alignment, alloced_size);
+  }
+
+  void *allocator::alloc(size_t size, size_t alignment, size_t &alloced_size) {
+    auto timed = latency_histogram::enabled();
+    probe::timer timer(timed);
+    auto ptr = alloc_impl(size, alignment, alloced_size);
+    if (timed) {
+      latency_histogram::record(latency_histogram::operation::allocator_alloc,
+                                timer.elapsed_ns());
+    }
+    return ptr;
+  }
+
+  void *allocator::alloc_impl(size_t size, size_t alignment,
+                              size_t &alloced_size) {
+    alloced_size = 0;
+    if (stripe_level.load(std::memory_order_relaxed) != 0) {
+      std::shared_lock lk(alloc_mutex);
+      auto level = stripe_level.load(std::memory_order_relaxed);
+      if (level != 0 &&
+          node_size(size, alignment) <= (1ULL << (max_level - level))) {
+        return alloc_in_stripes(size, alignment, alloced_size);
+      }
+    }
+
+    //樂觀查找在鎖外進行，鎖內只驗證和標記
+    auto needed_size = node_size(size, alignment);
+    auto optimistic_search =
+        optimistic.load(std::memory_order_relaxed) &&
+        policy.load(std::memory_order_relaxed) == fit_policy::first_fit &&
+        needed_size <= (1ULL << max_level);
+    size_t candidate = npos;
+    uint8_t level = 0;
+    uint64_t version = 0;
+    if (optimistic_search) {
+      version = tree_version.load(std::memory_order_acquire);
+      candidate = find_first_fit(needed_size, level);
+    }
+
+    std::lock_guard lk(alloc_mutex);
+    version_guard version_lk(tree_version);
+    if (tlsf_engine) {
+      auto ptr = tlsf_engine->alloc(size, alignment, alloced_size);
+      used_size += alloced_size;
+      return ptr;
+    }
+
+    size_t index = npos;
+    if (candidate != npos && index_words.empty() &&
+        stripe_level.load(std::memory_order_relaxed) == 0) {
+      index = commit_node(candidate, level, needed_size, version);
+    }
+    if (index == npos) {
+      merge_stripes();
+      index = take_node(needed_size, level);
+      if (index == npos && keeps_unmerged() && merge_deferred_nodes()) {
+        index = take_node(needed_size, level);
+      }
+      restore_stripes();
+    }
+    if (index == npos) {
       return nullptr;
     }
+    alloced_size = 1ULL << (max_level - level);
+    auto ptr =
+        static_cast<uint8_t *>(data) + _index_offset(index, level, max_level);
 
+    if (alignment > 1) {
+      auto remainder = reinterpret_cast<uintptr_t>(ptr) % alignment;
+      if (remainder != 0) {
+        set_node_status(index, node_status::used_with_alignment);
+        ptr += alignment - remainder;
+      }
+    }
+    return ptr;
+  }
+
+  bool allocator::set_engine(block_engine engine_) {
+    //只在塊沒有被共享時切換，所以不加鎖比較
+    if (engine_ == engine()) {
+      return true;
+    }
+    std::lock_guard lk(alloc_mutex);
+    if (used_size != 0) {
+      spdlog::warn("can't switch engine of block {} in use", block_id);
+      return false;
+    }
+    if (engine_ == block_engine::buddy) {
+      tlsf_engine.reset();
+      return true;
+    }
+    if (external_memory || (1ULL << max_level) < tlsf::min_block_size ||
+        stripe_level.load(std::memory_order_relaxed) != 0 ||
+        optimistic.load()) {
+      return false;
+    }
+    tlsf_engine = std::make_unique<tlsf>(data, 1ULL << max_level);
+    return true;
+  }
+
+  size_t allocator::alloc_node(size_t size) {
+    std::lock_guard lk(alloc_mutex);
+    version_guard version_lk(tree_version);
+    if (tlsf_engine) {
+      return npos;
+    }
+    uint8_t level = 0;
+    merge_stripes();
+    auto index = take_node(node_size(size, 1), level);
+    if (index == npos && keeps_unmerged() && merge_deferred_nodes()) {
+      index = take_node(node_size(size, 1), level);
+    }
+    restore_stripes();
+    return index;
+  }
+
+  void *allocator::node_address(size_t index) const {
+    if (index >= (2ULL << max_level) - 1) {
+      return nullptr;
+    }
+    auto level = static_cast<uint8_t>(std::bit_width(index + 1) - 1);
+    return static_cast<uint8_t *>(data) +
+           _index_offset(index, level, max_level);
+  }
+
+  bool allocator::free_node(size_t index) {
+    size_t freed_size = 0;
+    return free_node(index, freed_size);
+  }
+
+  bool allocator::free_node(size_t index, size_t &freed_size) {
+    if (index >= (2ULL << max_level) - 1) {
+      return false;
+    }
+    auto level = static_cast<uint8_t>(std::bit_width(index + 1) - 1);
+
+    std::lock_guard lk(alloc_mutex);
+    version_guard version_lk(tree_version);
+    if (tlsf_engine) {
+      return false;
+    }
+    //不可達的節點狀態都是unused，所以這裏不需要檢查祖先
+    if (get_node_status(index) != node_status::used) {
+      spdlog::debug("allocator can't free unallocated node");
+      return false;
+    }
+    freed_size = 1ULL << (max_level - level);
+    used_size -= freed_size;
+    release_node(index, level);
+    restore_stripes();
+    return true;
+  }
+
+  size_t allocator::take_node(size_t size, uint8_t &level) {
     size_t length = 1ULL << max_level;
 
-    if (size > length) {
+    //我们目前的参数类型决定了只能分配这么多
+    if (size > static_cast<size_t>(UINT32_MAX) || size > length) {
       spdlog::warn("too large size {}", size);
-      return nullptr;
+      if (CUDA_BUDDY_PROBE_ENABLED(allocator_alloc_fail)) {
+        CUDA_BUDDY_PROBE(allocator_alloc_fail, block_id, size,
+                         std::bit_width(size) - 1);
+      }
+      return npos;
+    }
+
+    if (policy.load(std::memory_order_relaxed) == fit_policy::best_fit) {
+      return take_best_fit_node(size, level);
+    }
+    if (!index_words.empty()) {
+      return take_indexed_node(size, level);
     }
 
+    auto target_level =
+        static_cast<uint8_t>(max_level - (std::bit_width(size) - 1));
+    //分條帶時釋放不更新hint
+    auto hint = stripe_level.load(std::memory_order_relaxed) == 0
+                    ? search_hint[target_level].load(std::memory_order_relaxed)
+                    : 0;
     size_t index = 0;
-    uint8_t level = 0;
+    level = 0;
 
     while (true) {
       if (size == length) {
         if (get_node_status(index) == node_status::unused) {
           used_size += size;
-          auto ptr = static_cast<uint8_t *>(data) +
-                     _index_offset(index, level, max_level);
-
-          if (alignment > 1) {
-            auto remainder = reinterpret_cast<uintptr_t>(ptr) % alignment;
-            if (remainder != 0) {
-              set_node_status(index, node_status::used_with_alignment);
-              ptr += alignment - remainder;
-              return ptr;
-            }
-          }
+          free_node_num[level]--;
           set_node_status(index, node_status::used);
-          return ptr;
+          advance_hints(_index_offset(index, level, max_level), level);
+          return index;
         }
       } else {
         // size < length
@@ -178,14 +398,16 @@ namespace cuda_buddy {
             break;
           case node_status::unused:
             // split first
-            set_node_status(index, node_status::splited);
-            set_node_status(left_child_index(index), node_status::unused);
-            set_node_status(right_child_index(index), node_status::unused);
+            split_node(index, level);
             [[fallthrough]];
           default:
             index = left_child_index(index);
             length /= 2;
             level++;
+            //hint之前沒有可用的節點，整個左子樹都在hint之前時直接跳到右子樹
+            if (_index_offset(index, level, max_level) + length <= hint) {
+              ++index;
+            }
             continue;
         }
       }
@@ -208,12 +430,283 @@ namespace cuda_buddy {
         break;
       }
     }
-    return nullptr;
+    if (!external_memory) {
+      search_hint[target_level].store(length, std::memory_order_relaxed);
+    }
+    if (CUDA_BUDDY_PROBE_ENABLED(allocator_alloc_fail)) {
+      CUDA_BUDDY_PROBE(allocator_alloc_fail, block_id, size,
+                       std::bit_width(size) - 1);
+    }
+    return npos;
+  }
+
+  size_t allocator::find_first_fit(size_t size, uint8_t &level) const
+      noexcept {
+    auto target_level =
+        static_cast<uint8_t>(max_level - (std::bit_width(size) - 1));
+    auto hint = search_hint[target_level].load(std::memory_order_relaxed);
+    size_t length = 1ULL << max_level;
+    size_t index = 0;
+    level = 0;
+    while (true) {
+      auto status = get_node_status(index);
+      if (status == node_status::unused) {
+        return index;
+      }
+      if (status == node_status::splited && length > size) {
+        index = left_child_index(index);
+        length /= 2;
+        level++;
+        if (_index_offset(index, level, max_level) + length <= hint) {
+          ++index;
+        }
+        continue;
+      }
+      // 回退到還有右兄弟的祖先
+      while (index != 0 && !(index & 1)) {
+        index = parent_index(index);
+        length *= 2;
+        level--;
+      }
+      if (index == 0) {
+        return npos;
+      }
+      ++index;
+    }
+  }
+
+  size_t allocator::commit_node(size_t index, uint8_t &level, size_t size,
+                                uint64_t version) {
+    //查找期間沒有寫入時候選節點就是first_fit的結果，否則只保證仍然可用
+    auto unchanged = tree_version.load(std::memory_order_relaxed) == version;
+    if (!unchanged) {
+      if (get_node_status(index) != node_status::unused) {
+        return npos;
+      }
+      for (auto ancestor = index; ancestor != 0;) {
+        ancestor = parent_index(ancestor);
+        if (get_node_status(ancestor) != node_status::splited) {
+          return npos;
+        }
+      }
+    }
+    auto target_level =
+        static_cast<uint8_t>(max_level - (std::bit_width(size) - 1));
+    for (; level < target_level; level++) {
+      split_node(index, level);
+      index = left_child_index(index);
+    }
+    used_size += size;
+    free_node_num[level]--;
+    set_node_status(index, node_status::used);
+    //不是最左的可用節點時推進hint會跳過空閒節點
+    if (unchanged) {
+      advance_hints(_index_offset(index, level, max_level), level);
+    }
+    return index;
+  }
+
+  size_t allocator::take_best_fit_node(size_t size, uint8_t &level) {
+    level = static_cast<uint8_t>(max_level - (std::bit_width(size) - 1));
+    //從能容納size的最小空閒節點切分，沒有被切分過的大節點留給以後的大請求
+    auto from_level = level;
+    while (free_node_num[from_level] == 0) {
+      if (from_level == 0) {
+        if (CUDA_BUDDY_PROBE_ENABLED(allocator_alloc_fail)) {
+          CUDA_BUDDY_PROBE(allocator_alloc_fail, block_id, size,
+                           std::bit_width(size) - 1);
+        }
+        return npos;
+      }
+      from_level--;
+    }
+    auto index = find_free_node(from_level);
+    assert(index != npos);
+    //找到的是這一層最左的空閒節點，下次從它之後找
+    if (!external_memory && stripe_level.load(std::memory_order_relaxed) == 0) {
+      free_hint[from_level].store(
+          _index_offset(index, from_level, max_level) +
+              (1ULL << (max_level - from_level)),
+          std::memory_order_relaxed);
+    }
+    auto changed_level = from_level;
+    for (; from_level < level; from_level++) {
+      split_node(index, from_level);
+      index = left_child_index(index);
+    }
+    used_size += size;
+    free_node_num[level]--;
+    set_node_status(index, node_status::used);
+    update_index(index, level, changed_level);
+    return index;
+  }
+
+  size_t allocator::take_indexed_node(size_t size, uint8_t &level) {
+    auto target_level =
+        static_cast<uint8_t>(max_level - (std::bit_width(size) - 1));
+    size_t index = 0;
+    level = 0;
+    if (subtree_free_level(index, level) > target_level) {
+      if (CUDA_BUDDY_PROBE_ENABLED(allocator_alloc_fail)) {
+        CUDA_BUDDY_PROBE(allocator_alloc_fail, block_id, size,
+                         std::bit_width(size) - 1);
+      }
+      return npos;
+    }
+
+    while (get_node_status(index) == node_status::splited) {
+      auto height = index_height[level];
+      if (height == 0) {
+        //最後一個索引層之下只有3層，直接比較左右子樹
+        index = left_child_index(index);
+        level++;
+        if (subtree_free_level(index, level) > target_level) {
+          ++index;
+        }
+        continue;
+      }
+      auto word = index_words[index_word_base[level] + index + 1 -
+                              (1ULL << level)];
+      //字節的值不大於target_level時這個字節的最高位置1，字節間不會借位
+      constexpr uint64_t low_bits = 0x0101010101010101ULL;
+      constexpr uint64_t high_bits = low_bits << 7;
+      auto fit_bits =
+          ~((word | high_bits) - low_bits * (target_level + 1)) & high_bits;
+      assert(fit_bits != 0);
+      auto slot = static_cast<size_t>(std::countr_zero(fit_bits) / 8);
+      //中間層的空閒節點覆蓋了它下面的所有後代，遇到時從它切分
+      for (auto bit = height; bit > 0; bit--) {
+        index = left_child_index(index) + ((slot >> (bit - 1)) & 1);
+        level++;
+        if (get_node_status(index) != node_status::splited) {
+          break;
+        }
+      }
+    }
+    assert(get_node_status(index) == node_status::unused);
+
+    auto changed_level = level;
+    for (; level < target_level; level++) {
+      split_node(index, level);
+      index = left_child_index(index);
+    }
+    used_size += size;
+    free_node_num[level]--;
+    set_node_status(index, node_status::used);
+    update_index(index, level, changed_level);
+    return index;
+  }
+
+  void allocator::split_node(size_t index, uint8_t level) noexcept {
+    set_node_status(index, node_status::splited);
+    set_node_status(left_child_index(index), node_status::unused);
+    set_node_status(right_child_index(index), node_status::unused);
+    sub_count(free_node_num[level], 1);
+    add_count(free_node_num[level + 1], 2);
+    if (auto offset = _index_offset(index, level, max_level);
+        free_hint[level + 1].load(std::memory_order_relaxed) > offset) {
+      free_hint[level + 1].store(offset, std::memory_order_relaxed);
+    }
+  }
+
+  size_t allocator::find_free_node(uint8_t level) const {
+    //hint之前沒有這一層的空閒節點
+    size_t hint = 0;
+    if (stripe_level.load(std::memory_order_relaxed) == 0) {
+      hint = (std::max)(search_hint[level].load(std::memory_order_relaxed),
+                        free_hint[level].load(std::memory_order_relaxed));
+    }
+    size_t index = 0;
+    uint8_t cur_level = 0;
+    while (true) {
+      auto status = get_node_status(index);
+      if (cur_level == level) {
+        if (status == node_status::unused) {
+          return index;
+        }
+      } else if (status == node_status::splited) {
+        index = left_child_index(index);
+        cur_level++;
+        //整個左子樹都在hint之前時直接跳到右子樹
+        if (_index_offset(index, cur_level, max_level) +
+                (1ULL << (max_level - cur_level)) <=
+            hint) {
+          ++index;
+        }
+        continue;
+      }
+      // 回退到還有右兄弟的祖先
+      while (index != 0 && !(index & 1)) {
+        index = parent_index(index);
+        cur_level--;
+      }
+      if (index == 0) {
+        return npos;
+      }
+      ++index;
+    }
+  }
+
+  size_t allocator::presplit(uint8_t order, size_t node_num) {
+    if (order > max_level) {
+      return 0;
+    }
+    auto level = static_cast<uint8_t>(max_level - order);
+    std::lock_guard lk(alloc_mutex);
+    version_guard version_lk(tree_version);
+    if (tlsf_engine) {
+      return 0;
+    }
+    while (level > 0 && free_node_num[level] < node_num) {
+      //從最接近的上層切分，盡量保留大的空閒節點
+      auto from_level = static_cast<uint8_t>(level - 1);
+      while (from_level > 0 && free_node_num[from_level] == 0) {
+        from_level--;
+      }
+      if (free_node_num[from_level] == 0) {
+        break;
+      }
+      auto index = find_free_node(from_level);
+      if (index == npos) {
+        break;
+      }
+      auto changed_level = from_level;
+      for (; from_level < level; from_level++) {
+        split_node(index, from_level);
+        index = left_child_index(index);
+      }
+      update_index(index, level, changed_level);
+      unmerged_num++;
+    }
+    presplit_num[level] = node_num;
+    presplit_active = true;
+    return free_node_num[level];
+  }
+
+  void allocator::clear_presplit() {
+    std::lock_guard lk(alloc_mutex);
+    if (!presplit_active) {
+      return;
+    }
+    version_guard version_lk(tree_version);
+    presplit_num.fill(0);
+    presplit_active = false;
+    if (max_deferred_num == 0) {
+      merge_stripes();
+      merge_deferred_nodes();
+      restore_stripes();
+    }
   }
 
   void *allocator::alloc(size_t size) { return alloc(size, 1); }
 
   bool allocator::free(void *ptr) {
+    size_t freed_size = 0;
+    return free(ptr, freed_size);
+  }
+
+  bool allocator::free(void *ptr, size_t &freed_size) {
+    freed_size = 0;
     if (!ptr) {
       return true;
     }
@@ -222,13 +715,36 @@ namespace cuda_buddy {
       return false;
     }
 
+    size_t offset = static_cast<uint8_t *>(ptr) - static_cast<uint8_t *>(data);
+    if (stripe_level.load(std::memory_order_relaxed) != 0) {
+      std::shared_lock lk(alloc_mutex);
+      if (stripe_level.load(std::memory_order_relaxed) != 0) {
+        if (auto res = free_in_stripe(offset, freed_size)) {
+          return *res;
+        }
+      }
+    }
+
     std::lock_guard lk(alloc_mutex);
+    version_guard version_lk(tree_version);
+    if (tlsf_engine) {
+      if (!tlsf_engine->free(ptr, freed_size)) {
+        return false;
+      }
+      used_size -= freed_size;
+      return true;
+    }
+    if (!release_offset(offset, 0, 0, freed_size)) {
+      return false;
+    }
+    restore_stripes();
+    return true;
+  }
 
-    size_t left = 0;
-    size_t length = 1ULL << max_level;
-    size_t index = 0;
-    uint8_t level = 0;
-    size_t offset = static_cast<uint8_t *>(ptr) - static_cast<uint8_t *>(data);
+  bool allocator::release_offset(size_t offset, size_t index, uint8_t level,
+                                 size_t &freed_size) {
+    size_t left = _index_offset(index, level, max_level);
+    size_t length = 1ULL << (max_level - level);
 
     while (level <= max_level) {
       auto cur_node_status = get_node_status(index);
@@ -252,8 +768,9 @@ namespace cuda_buddy {
             }
           }
         }
-          used_size -= (1ULL << (max_level - level));
-          combine(index);
+          freed_size = 1ULL << (max_level - level);
+          sub_count(used_size, freed_size);
+          release_node(index, level);
           return true;
         case node_status::unused:
           spdlog::get("cuda_buddy")
@@ -274,25 +791,585 @@ namespace cuda_buddy {
     return false;
   }
 
-  void allocator::combine(size_t index) noexcept {
-    while (index != 0) {
+  void allocator::set_lazy_coalescing(size_t max_deferred_num_) {
+    std::lock_guard lk(alloc_mutex);
+    version_guard version_lk(tree_version);
+    if (external_memory || stripe_level.load(std::memory_order_relaxed) != 0) {
+      return;
+    }
+    max_deferred_num = max_deferred_num_;
+    if (max_deferred_num == 0) {
+      merge_deferred_nodes();
+    }
+  }
+
+  bool allocator::set_wide_index(bool enable) {
+    //只在塊沒有被共享時切換，所以不加鎖比較
+    if (enable == !index_words.empty()) {
+      return true;
+    }
+    std::lock_guard lk(alloc_mutex);
+    if (!enable) {
+      std::vector<uint64_t>().swap(index_words);
+      return true;
+    }
+    if (external_memory || max_level < 4 ||
+        stripe_level.load(std::memory_order_relaxed) != 0 ||
+        optimistic.load()) {
+      return false;
+    }
+    //最後一個索引層離葉子3層，往上每3層一個，根節點所在的組可能不滿3層
+    index_height.fill(0);
+    size_t word_num = 0;
+    for (auto next_level = max_level - 3; next_level > 0; next_level -= 3) {
+      auto level = (std::max)(next_level - 3, 0);
+      index_height[level] = static_cast<uint8_t>(next_level - level);
+      index_word_base[level] = word_num;
+      word_num += 1ULL << level;
+    }
+    index_words.assign(word_num, UINT64_MAX);
+    rebuild_index();
+    return true;
+  }
+
+  bool allocator::set_lock_stripes(size_t stripe_num) {
+    //只在塊沒有被共享時切換，所以不加鎖比較
+    if (stripe_num == lock_stripes()) {
+      return true;
+    }
+    std::lock_guard lk(alloc_mutex);
+    if (stripe_num != 0 &&
+        (stripe_num == 1 || !std::has_single_bit(stripe_num) ||
+         stripe_num > 64 || std::bit_width(stripe_num) - 1 >= max_level ||
+         external_memory || tlsf_engine || max_deferred_num != 0 ||
+         !index_words.empty() || optimistic.load() ||
+         alloc_mutex.native().policy() != lock_policy::shared)) {
+      return false;
+    }
+    version_guard version_lk(tree_version);
+    //先恢復成普通的樹，條帶期間沒有維護hint
+    merge_stripes();
+    stripe_level.store(0);
+    reset_hints();
+    if (stripe_num == 0) {
+      stripe_locks.reset();
+      return true;
+    }
+    stripe_locks = std::make_unique<stripe_lock[]>(stripe_num);
+    stripe_level.store(static_cast<uint8_t>(std::bit_width(stripe_num) - 1));
+    restore_stripes();
+    return true;
+  }
+
+  bool allocator::set_optimistic_search(bool enable) {
+    //只在塊沒有被共享時切換，所以不加鎖比較
+    if (enable == optimistic.load()) {
+      return true;
+    }
+    std::lock_guard lk(alloc_mutex);
+    if (enable && (external_memory || tlsf_engine || !index_words.empty() ||
+                   stripe_level.load(std::memory_order_relaxed) != 0)) {
+      return false;
+    }
+    optimistic.store(enable);
+    return true;
+  }
+
+  bool allocator::set_lock_policy(lock_policy policy_) {
+    //只在塊沒有被其他線程使用時調用，所以不加鎖
+    if (policy_ == locking()) {
+      return true;
+    }
+    if (external_memory || stripe_level.load(std::memory_order_relaxed) != 0) {
+      return false;
+    }
+    return alloc_mutex.native().set_policy(policy_);
+  }
+
+  void *allocator::alloc_in_stripes(size_t size, size_t alignment,
+                                    size_t &alloced_size) {
+    auto top_level = stripe_level.load(std::memory_order_relaxed);
+    auto stripe_num = 1ULL << top_level;
+    auto needed_size = node_size(size, alignment);
+    //每個線程從上次成功的條帶開始，不同線程的初始條帶按線程id分散
+    thread_local size_t preferred_stripe =
+        std::hash<std::thread::id>{}(std::this_thread::get_id());
+    for (size_t i = 0; i < stripe_num; i++) {
+      auto stripe = (preferred_stripe + i) % stripe_num;
+      auto root = stripe_num - 1 + stripe;
+      //被條帶之上的大節點覆蓋的條帶不可達
+      if (get_node_status(parent_index(root)) != node_status::splited) {
+        continue;
+      }
+      std::lock_guard stripe_lk(stripe_locks[stripe].mutex);
+      uint8_t level = 0;
+      auto index = take_stripe_node(needed_size, root, level);
+      if (index == npos) {
+        continue;
+      }
+      preferred_stripe = stripe;
+      alloced_size = needed_size;
+      auto ptr =
+          static_cast<uint8_t *>(data) + _index_offset(index, level, max_level);
+      if (alignment > 1) {
+        auto remainder = reinterpret_cast<uintptr_t>(ptr) % alignment;
+        if (remainder != 0) {
+          set_node_status(index, node_status::used_with_alignment);
+          ptr += alignment - remainder;
+        }
+      }
+      return ptr;
+    }
+    if (CUDA_BUDDY_PROBE_ENABLED(allocator_alloc_fail)) {
+      CUDA_BUDDY_PROBE(allocator_alloc_fail, block_id, needed_size,
+                       std::bit_width(needed_size) - 1);
+    }
+    return nullptr;
+  }
+
+  size_t allocator::take_stripe_node(size_t size, size_t root,
+                                     uint8_t &level) {
+    level = stripe_level.load(std::memory_order_relaxed);
+    size_t length = 1ULL << (max_level - level);
+    size_t index = root;
+    while (true) {
+      auto status = get_node_status(index);
+      if (size == length) {
+        if (status == node_status::unused) {
+          add_count(used_size, size);
+          sub_count(free_node_num[level], 1);
+          set_node_status(index, node_status::used);
+          return index;
+        }
+      } else if (status == node_status::unused ||
+                 status == node_status::splited) {
+        if (status == node_status::unused) {
+          split_node(index, level);
+        }
+        index = left_child_index(index);
+        length /= 2;
+        level++;
+        continue;
+      }
+      // 回退到還有右兄弟的祖先，不離開這個條帶
+      while (index != root && !(index & 1)) {
+        index = parent_index(index);
+        length *= 2;
+        level--;
+      }
+      if (index == root) {
+        return npos;
+      }
+      ++index;
+    }
+  }
+
+  std::optional<bool> allocator::free_in_stripe(size_t offset,
+                                                size_t &freed_size) {
+    auto top_level = stripe_level.load(std::memory_order_relaxed);
+    size_t index = 0;
+    for (uint8_t level = 0; level < top_level; level++) {
+      if (get_node_status(index) != node_status::splited) {
+        return std::nullopt;
+      }
+      index = left_child_index(index) +
+              ((offset >> (max_level - level - 1)) & 1);
+    }
+    std::lock_guard stripe_lk(
+        stripe_locks[index + 1 - (1ULL << top_level)].mutex);
+    return release_offset(offset, index, top_level, freed_size);
+  }
+
+  void allocator::merge_stripes() noexcept {
+    auto top_level = stripe_level.load(std::memory_order_relaxed);
+    for (auto level = static_cast<int>(top_level) - 1; level >= 0; level--) {
+      for (auto index = (1ULL << level) - 1; index < (2ULL << level) - 1;
+           index++) {
+        if (get_node_status(index) == node_status::splited &&
+            get_node_status(left_child_index(index)) == node_status::unused &&
+            get_node_status(right_child_index(index)) == node_status::unused) {
+          free_node_num[level + 1] -= 2;
+          free_node_num[level]++;
+          set_node_status(index, node_status::unused);
+        }
+      }
+    }
+  }
+
+  void allocator::restore_stripes() noexcept {
+    auto top_level = stripe_level.load(std::memory_order_relaxed);
+    //splited的節點都是可達的，所以父節點是splited時這個空閒節點可達
+    for (uint8_t level = 0; level < top_level; level++) {
+      for (auto index = (1ULL << level) - 1; index < (2ULL << level) - 1;
+           index++) {
+        if (get_node_status(index) == node_status::unused &&
+            (index == 0 ||
+             get_node_status(parent_index(index)) == node_status::splited)) {
+          split_node(index, level);
+        }
+      }
+    }
+  }
+
+  uint8_t allocator::merged_free_level(size_t index, uint8_t level) const
+      noexcept {
+    auto status = get_node_status(index);
+    if (status == node_status::unused) {
+      return level;
+    }
+    auto top_level = stripe_level.load(std::memory_order_relaxed);
+    if (status != node_status::splited ||
+        (top_level != 0 && level == top_level)) {
+      return index_none;
+    }
+    auto left_level = merged_free_level(left_child_index(index), level + 1);
+    auto right_level = merged_free_level(right_child_index(index), level + 1);
+    if (left_level == level + 1 && right_level == level + 1) {
+      return level;
+    }
+    return (std::min)(left_level, right_level);
+  }
+
+  uint8_t allocator::subtree_free_level(size_t index, uint8_t level) const
+      noexcept {
+    switch (get_node_status(index)) {
+      case node_status::unused:
+        return level;
+      case node_status::splited:
+        break;
+      default:
+        return index_none;
+    }
+    if (index_height[level] == 0) {
+      return (std::min)(subtree_free_level(left_child_index(index), level + 1),
+                        subtree_free_level(right_child_index(index), level + 1));
+    }
+    auto word =
+        index_words[index_word_base[level] + index + 1 - (1ULL << level)];
+    auto res = index_none;
+    for (size_t slot = 0; slot < 8; slot++, word >>= 8) {
+      res = (std::min)(res, static_cast<uint8_t>(word & 0xFF));
+    }
+    return res;
+  }
+
+  uint64_t allocator::compute_index_word(size_t index, uint8_t level) const
+      noexcept {
+    auto height = index_height[level];
+    uint64_t word = UINT64_MAX;
+    //先序遍歷中間層，遇到不是splited的節點時它覆蓋的字節都取同一個值
+    struct frame {
+      size_t index;
+      uint8_t level;
+      size_t first_slot;
+    };
+    std::array<frame, 8> stack;
+    size_t top = 0;
+    stack[top++] = {left_child_index(index), static_cast<uint8_t>(level + 1),
+                    0};
+    stack[top++] = {right_child_index(index), static_cast<uint8_t>(level + 1),
+                    1ULL << (height - 1)};
+    while (top != 0) {
+      auto cur = stack[--top];
+      auto depth = cur.level - level;
+      auto slot_num = 1ULL << (height - depth);
+      uint8_t value = index_none;
+      if (depth == height) {
+        value = subtree_free_level(cur.index, cur.level);
+      } else {
+        switch (get_node_status(cur.index)) {
+          case node_status::unused:
+            value = cur.level;
+            break;
+          case node_status::splited:
+            stack[top++] = {left_child_index(cur.index),
+                            static_cast<uint8_t>(cur.level + 1),
+                            cur.first_slot};
+            stack[top++] = {right_child_index(cur.index),
+                            static_cast<uint8_t>(cur.level + 1),
+                            cur.first_slot + slot_num / 2};
+            continue;
+          default:
+            break;
+        }
+      }
+      for (auto slot = cur.first_slot; slot < cur.first_slot + slot_num;
+           slot++) {
+        word &= ~(uint64_t(0xFF) << (slot * 8));
+        word |= uint64_t(value) << (slot * 8);
+      }
+    }
+    return word;
+  }
+
+  void allocator::update_index(size_t index, uint8_t level,
+                               uint8_t changed_level) noexcept {
+    if (index_words.empty()) {
+      return;
+    }
+    for (int ancestor_level = level; ancestor_level >= 0; ancestor_level--) {
+      auto height = index_height[ancestor_level];
+      if (height == 0) {
+        continue;
+      }
+      auto ancestor = ((index + 1) >> (level - ancestor_level)) - 1;
+      auto &word = index_words[index_word_base[ancestor_level] + ancestor + 1 -
+                               (1ULL << ancestor_level)];
+      uint64_t new_word = 0;
+      auto slot_level = ancestor_level + height;
+      if (slot_level <= changed_level) {
+        //中間層的狀態沒有變，只有路徑上的那個後代的字節可能變了
+        auto slot_index = ((index + 1) >> (level - slot_level)) - 1;
+        auto slot = slot_index + 1 - ((ancestor + 1) << height);
+        new_word = word & ~(uint64_t(0xFF) << (slot * 8));
+        new_word |= uint64_t(subtree_free_level(
+                        slot_index, static_cast<uint8_t>(slot_level)))
+                    << (slot * 8);
+      } else {
+        new_word =
+            compute_index_word(ancestor, static_cast<uint8_t>(ancestor_level));
+      }
+      if (new_word == word && ancestor_level < changed_level) {
+        return;
+      }
+      word = new_word;
+    }
+  }
+
+  void allocator::rebuild_index() noexcept {
+    if (index_words.empty()) {
+      return;
+    }
+    std::vector<size_t> indexed_nodes;
+    std::vector<size_t> indexes{0};
+    while (!indexes.empty()) {
+      auto index = indexes.back();
+      indexes.pop_back();
+      if (get_node_status(index) != node_status::splited) {
+        continue;
+      }
+      auto level = static_cast<uint8_t>(std::bit_width(index + 1) - 1);
+      if (index_height[level] != 0) {
+        indexed_nodes.push_back(index);
+      }
+      indexes.push_back(right_child_index(index));
+      indexes.push_back(left_child_index(index));
+    }
+    //先序的逆序保證後代的索引字先算好
+    for (auto it = indexed_nodes.rbegin(); it != indexed_nodes.rend(); ++it) {
+      auto level = static_cast<uint8_t>(std::bit_width(*it + 1) - 1);
+      index_words[index_word_base[level] + *it + 1 - (1ULL << level)] =
+          compute_index_word(*it, level);
+    }
+  }
+
+  void allocator::release_node(size_t index, uint8_t level) noexcept {
+    if (max_deferred_num == 0 || free_node_num[level] >= max_deferred_num) {
+      combine(index, level);
+      return;
+    }
+    set_node_status(index, node_status::unused);
+    free_node_num[level]++;
+    unmerged_num++;
+    lower_hints(_index_offset(index, level, max_level), level);
+    update_index(index, level, level);
+  }
+
+  bool allocator::merge_deferred_nodes() {
+    if (unmerged_num == 0) {
+      return false;
+    }
+    unmerged_num = 0;
+    std::vector<size_t> splited_indexes;
+    std::vector<size_t> indexes{0};
+    while (!indexes.empty()) {
+      auto index = indexes.back();
+      indexes.pop_back();
+      if (get_node_status(index) == node_status::splited) {
+        splited_indexes.push_back(index);
+        indexes.push_back(right_child_index(index));
+        indexes.push_back(left_child_index(index));
+      }
+    }
+    //先序的逆序保證子節點先於父節點處理，合併可以一直向上
+    bool merged = false;
+    for (auto it = splited_indexes.rbegin(); it != splited_indexes.rend();
+         ++it) {
+      auto index = *it;
+      if (get_node_status(left_child_index(index)) != node_status::unused ||
+          get_node_status(right_child_index(index)) != node_status::unused) {
+        continue;
+      }
+      auto level = static_cast<uint8_t>(std::bit_width(index + 1) - 1);
+      free_node_num[level + 1] -= 2;
+      free_node_num[level]++;
+      set_node_status(index, node_status::unused);
+      merged = true;
+    }
+    if (merged) {
+      reset_hints();
+      rebuild_index();
+    }
+    return merged;
+  }
+
+  void allocator::combine(size_t index, uint8_t level) noexcept {
+    //合併後不可達的節點也保持unused，free_node依賴這一點
+    set_node_status(index, node_status::unused);
+    auto from_level = level;
+    //分條帶時不合併到條帶之上
+    auto top_level = stripe_level.load(std::memory_order_relaxed);
+    while (level > top_level) {
       if (get_node_status(sibling_index(index)) != node_status::unused) {
         break;
       }
+      //保留presplit切出的空閒節點
+      if (load_count(free_node_num[level]) <= presplit_num[level]) {
+        add_count(unmerged_num, 1);
+        break;
+      }
+      sub_count(free_node_num[level], 1);
       index = parent_index(index);
+      level--;
     }
 
     set_node_status(index, node_status::unused);
-    while (index > 0) {
+    add_count(free_node_num[level], 1);
+    lower_hints(_index_offset(index, level, max_level), level);
+    if (CUDA_BUDDY_PROBE_ENABLED(allocator_combine)) {
+      CUDA_BUDDY_PROBE(allocator_combine, block_id, max_level - from_level,
+                       max_level - level);
+    }
+    update_index(index, level, level);
+    for (; level > top_level; level--) {
       index = parent_index(index);
       set_node_status(index, node_status::splited);
     }
   }
 
+  std::vector<uint8_t> allocator::occupancy(size_t resolution) const {
+    if (resolution == 0) {
+      return {};
+    }
+    resolution =
+        std::min<size_t>(next_pow_of_2(resolution), 1ULL << max_level);
+    auto bucket_level = static_cast<uint8_t>(std::bit_width(resolution) - 1);
+    auto bucket_size = (1ULL << max_level) / resolution;
+    std::vector<size_t> used_bytes(resolution, 0);
+
+    {
+      std::shared_lock lk(alloc_mutex);
+      if (tlsf_engine) {
+        return tlsf_engine->occupancy(resolution);
+      }
+      std::vector<size_t> indexes{0};
+      while (!indexes.empty()) {
+        auto index = indexes.back();
+        indexes.pop_back();
+        auto level = static_cast<uint8_t>(std::bit_width(index + 1) - 1);
+        switch (get_node_status(index)) {
+          case node_status::unused:
+            break;
+          case node_status::used:
+            [[fallthrough]];
+          case node_status::used_with_alignment: {
+            auto offset = _index_offset(index, level, max_level);
+            auto length = 1ULL << (max_level - level);
+            if (level <= bucket_level) {
+              for (auto i = offset / bucket_size;
+                   i < (offset + length) / bucket_size; i++) {
+                used_bytes[i] = bucket_size;
+              }
+            } else {
+              used_bytes[offset / bucket_size] += length;
+            }
+          } break;
+          case node_status::splited:
+            indexes.push_back(right_child_index(index));
+            indexes.push_back(left_child_index(index));
+            break;
+        }
+      }
+    }
+
+    std::vector<uint8_t> res(resolution);
+    for (size_t i = 0; i < resolution; i++) {
+      res[i] = static_cast<uint8_t>((used_bytes[i] * 255 + bucket_size - 1) /
+                                    bucket_size);
+    }
+    return res;
+  }
+
+  void allocator::advance_hints(size_t offset, uint8_t level) noexcept {
+    if (external_memory || stripe_level.load(std::memory_order_relaxed) != 0) {
+      return;
+    }
+    //offset是level層最左的可用位置，包含它的上層節點之前也沒有可用的位置
+    for (uint8_t l = 0; l <= level; l++) {
+      auto length = 1ULL << (max_level - l);
+      auto hint = search_hint[l].load(std::memory_order_relaxed);
+      if (hint < (offset / length + 1) * length) {
+        search_hint[l].store((offset / length + 1) * length,
+                             std::memory_order_relaxed);
+      }
+    }
+  }
+
+  void allocator::lower_hints(size_t offset, uint8_t level) noexcept {
+    if (stripe_level.load(std::memory_order_relaxed) != 0) {
+      return;
+    }
+    for (size_t l = level; l < search_hint.size(); l++) {
+      if (search_hint[l].load(std::memory_order_relaxed) > offset) {
+        search_hint[l].store(offset, std::memory_order_relaxed);
+      }
+    }
+    if (free_hint[level].load(std::memory_order_relaxed) > offset) {
+      free_hint[level].store(offset, std::memory_order_relaxed);
+    }
+  }
+
+  void allocator::reset_hints() noexcept {
+    for (auto &hint : search_hint) {
+      hint.store(0, std::memory_order_relaxed);
+    }
+    for (auto &hint : free_hint) {
+      hint.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  void allocator::rebuild_summary() noexcept {
+    reset_hints();
+    used_size = 0;
+    free_node_num.fill(0);
+    std::vector<size_t> indexes{0};
+    while (!indexes.empty()) {
+      auto index = indexes.back();
+      indexes.pop_back();
+      auto level = static_cast<uint8_t>(std::bit_width(index + 1) - 1);
+      switch (get_node_status(index)) {
+        case node_status::unused:
+          free_node_num[level]++;
+          break;
+        case node_status::used:
+          [[fallthrough]];
+        case node_status::used_with_alignment:
+          used_size += 1ULL << (max_level - level);
+          break;
+        case node_status::splited:
+          indexes.push_back(right_child_index(index));
+          indexes.push_back(left_child_index(index));
+          break;
+      }
+    }
+  }
+
   allocator::node_status inline allocator::get_node_status(size_t index) const
       noexcept {
-    return static_cast<node_status>((tree[index / 4] >> (6 - (index % 4 * 2))) %
-                                    4);
+    //分條帶和樂觀查找時有不持有獨佔鎖的讀者
+    auto byte =
+        std::atomic_ref(tree[index / 4]).load(std::memory_order_relaxed);
+    return static_cast<node_status>((byte >> (6 - (index % 4 * 2))) % 4);
   }
 
   void inline allocator::set_node_status(size_t index,
@@ -300,7 +1377,18 @@ namespace cuda_buddy {
 
     size_t cnt = 6 - (index % 4 * 2);
     uint8_t mask = 3;
-    tree[index / 4] &= (~(mask << cnt));
-    tree[index / 4] |= (static_cast<uint8_t>(status) << cnt);
+    if (stripe_level.load(std::memory_order_relaxed) != 0) {
+      std::atomic_ref byte(tree[index / 4]);
+      byte.fetch_and(static_cast<uint8_t>(~(mask << cnt)),
+                     std::memory_order_relaxed);
+      byte.fetch_or(static_cast<uint8_t>(static_cast<uint8_t>(status) << cnt),
+                    std::memory_order_relaxed);
+      return;
+    }
+    std::atomic_ref byte(tree[index / 4]);
+    byte.store(static_cast<uint8_t>(
+                   (byte.load(std::memory_order_relaxed) & ~(mask << cnt)) |
+                   (static_cast<uint8_t>(status) << cnt)),
+               std::memory_order_relaxed);
   }
 } // namespace cuda_buddy
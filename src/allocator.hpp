@@ -8,12 +8,33 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <shared_mutex>
+#include <vector>
+
+#include "allocator_mutex.hpp"
+#include "lock_stats.hpp"
+#include "tlsf.hpp"
 
 namespace cuda_buddy {
 
   enum class alloc_location { device = 0, host };
+  //! buddy選擇節點的策略
+  /*!
+   * first_fit取深度優先找到的最左節點，best_fit先用大小剛好的空閒節點，
+   * 沒有時切分最小的足夠大的節點，保留大的連續空間，代價是查找不再局限於左側。
+   * best_fit不一定碎片更少：bench/fragmentation_bench的混合負載下，
+   * 它的最大空閒節點佔空閒字節的比例更高(0.30對0.14)，但分配失敗更多
+   * (3947對3164)，每次操作也慢約4倍，使用前應該用實際負載比較。
+   */
+  enum class fit_policy { first_fit = 0, best_fit };
+  //! 塊內的分配算法，tlsf的內部碎片較少，但不支持按節點下標分配
+  enum class block_engine { buddy = 0, tlsf };
 
   class allocator final {
 
@@ -21,7 +42,23 @@ namespace cuda_buddy {
     allocator() = delete;
 
     explicit allocator(uint8_t max_level_,
-                       alloc_location data_location_ = alloc_location::device);
+                       alloc_location data_location_ = alloc_location::device,
+                       uint32_t id_ = 0);
+    //! 可以放在共享內存中的鎖和統計，多個進程通過它共用一個塊
+    struct shared_state {
+      pthread_mutex_t mutex;
+      size_t used_size;
+      std::array<size_t, 33> free_node_num;
+    };
+    static void init_shared_state(shared_state &state);
+
+    //! 使用外部的樹、數據和狀態(例如共享內存)，沿用其中已有的分配，析構時不釋放
+    allocator(uint8_t max_level_, uint8_t *tree_, void *data_,
+              shared_state &state, uint32_t id_);
+    //! 樹需要的字節數
+    static size_t tree_size(uint8_t max_level_) {
+      return (1ULL << max_level_) / 2;
+    }
     allocator(const allocator &) = delete;
     allocator &operator=(const allocator &) = delete;
 
@@ -32,7 +69,77 @@ namespace cuda_buddy {
 
     void *alloc(size_t size);
     void *alloc(size_t size, size_t alignment);
+    //! alloced_size返回實際佔用的字節數
+    void *alloc(size_t size, size_t alignment, size_t &alloced_size);
     bool free(void *ptr);
+    //! freed_size返回釋放的節點大小
+    bool free(void *ptr, size_t &freed_size);
+
+    //! 切換分配算法，只能在沒有分配時切換，共享內存中的塊只能用buddy
+    bool set_engine(block_engine engine_);
+    block_engine engine() const {
+      return tlsf_engine ? block_engine::tlsf : block_engine::buddy;
+    }
+
+    void set_fit_policy(fit_policy policy_) { policy.store(policy_); }
+
+    //! 延遲合併，一層的空閒節點少於max_deferred_num_時釋放的節點不合併
+    /*!
+     * 同樣大小反覆分配和釋放時不必每次切分和合併多層。空閒節點達到上限後
+     * 釋放的節點照常合併，分配失敗時合併整棵樹後重試。largest_free和
+     * can_alloc按合併後的大小計算。0表示立即合併(默認)，共享內存中的塊不支持。
+     */
+    void set_lazy_coalescing(size_t max_deferred_num_);
+
+    //! 8叉索引，first_fit分配每次下降3層
+    /*!
+     * 每隔3層的節點用一個64位字記錄往下3層的8個後代子樹中最大空閒節點
+     * 的層數，分配時用位運算一次選出最左的足夠大的後代，不再逐個遍歷
+     * 已佔用的節點。塊的語義仍是二叉buddy，釋放後沿路徑更新索引。
+     * 2^28的塊約需38MB，關閉時釋放。共享內存中的塊和小於16字節的塊不支持。
+     */
+    bool set_wide_index(bool enable);
+
+    //! 把樹按第log2(stripe_num)層分成stripe_num個條帶，每個條帶一把鎖
+    /*!
+     * 不大於條帶的分配和釋放只持有alloc_mutex的共享鎖和所在條帶的鎖，
+     * 不同條帶的操作可以並行，每個線程從上次成功的條帶開始找。條帶之上
+     * 的節點保持切分，更大的分配和釋放持有獨佔鎖，臨時合併空閒的條帶。
+     * 條帶內總是first_fit，不能和tlsf、延遲合併、8叉索引一起使用，
+     * 共享內存中的塊不支持。stripe_num是2的冪，0表示不分條帶(默認)。
+     */
+    bool set_lock_stripes(size_t stripe_num);
+
+    size_t lock_stripes() const {
+      auto level = stripe_level.load(std::memory_order_relaxed);
+      return level == 0 ? 0 : 1ULL << level;
+    }
+
+    //! first_fit分配先不加鎖查找，加鎖後只驗證和標記節點
+    /*!
+     * 查找期間樹被其他線程修改時版本號會變，加鎖後重新檢查候選節點
+     * 仍然空閒且可達，失效時在鎖內重新查找。不能和tlsf、條帶鎖、
+     * 8叉索引一起使用，共享內存中的塊不支持。
+     */
+    bool set_optimistic_search(bool enable);
+
+    //! alloc_mutex的實現，見lock_policy
+    /*!
+     * 只在塊沒有被其他線程使用時切換。none時largest_free、free_bytes、
+     * can_alloc和occupancy等查詢同樣不加鎖，只能在使用塊的線程中調用。
+     * 條帶鎖需要shared，共享內存中的塊固定使用進程間鎖。
+     */
+    bool set_lock_policy(lock_policy policy_);
+    lock_policy locking() const { return alloc_mutex.native().policy(); }
+
+    //! 按節點下標分配和釋放，釋放時不需要從根節點查找地址
+    static constexpr size_t npos = SIZE_MAX;
+    size_t alloc_node(size_t size);
+    bool free_node(size_t index);
+    bool free_node(size_t index, size_t &freed_size);
+    void *node_address(size_t index) const;
+    uint32_t id() const { return block_id; }
+
     bool in_buddy(const void *ptr) const {
       return static_cast<const uint8_t *>(ptr) >=
                  static_cast<const uint8_t *>(data) &&
@@ -41,7 +148,42 @@ namespace cuda_buddy {
     }
     bool full() const {
       std::shared_lock lk(alloc_mutex);
-      return used_size == 0;
+      return load_count(used_size) == 0;
+    }
+    size_t free_bytes() const {
+      std::shared_lock lk(alloc_mutex);
+      return (1ULL << max_level) - load_count(used_size);
+    }
+    //! 最大的空閒節點大小，由每層空閒節點計數得出，不需要遍歷樹
+    size_t largest_free() const;
+    bool can_alloc(size_t size, size_t alignment) const {
+      auto needed_size = tlsf_engine ? tlsf::block_size(size, alignment)
+                                     : node_size(size, alignment);
+      return needed_size <= largest_free();
+    }
+    //! alloc(size,alignment)實際佔用的節點大小
+    static size_t node_size(size_t size, size_t alignment);
+
+    //! 預先切分出大小為2^order的空閒節點，直到這一層有node_num個
+    /*!
+     * 從最接近的上層空閒節點往下切分，返回這一層實際的空閒節點數。
+     * 之後釋放時這一層至少保留node_num個空閒節點不合併，分配失敗時
+     * 才把保留的兄弟合併起來，所以切分的效果不會被合併抵消。
+     */
+    size_t presplit(uint8_t order, size_t node_num);
+    //! 取消所有presplit的保留並合併空閒的兄弟節點
+    void clear_presplit();
+
+    //! 把塊等分成resolution段，返回每段被佔用的比例(0到255)
+    /*!
+     * resolution向上取整到2的冪，不超過塊大小。只要有字節被佔用，
+     * 對應段的值至少是1。需要遍歷所有可達節點，用於調試和容量調優。
+     */
+    std::vector<uint8_t> occupancy(size_t resolution) const;
+
+    //! alloc_mutex的爭用統計，見lock_stats
+    lock_stats::snapshot lock_statistics() const {
+      return alloc_mutex.statistics();
     }
 
     void sync_stream() const;
@@ -53,21 +195,126 @@ namespace cuda_buddy {
       used_with_alignment = 2,
       splited = 3,
     };
-    void combine(size_t index) noexcept;
+    void *alloc_impl(size_t size, size_t alignment, size_t &alloced_size);
+    size_t take_node(size_t size, uint8_t &level);
+    size_t take_best_fit_node(size_t size, uint8_t &level);
+    size_t take_indexed_node(size_t size, uint8_t &level);
+    //! 不修改樹的first_fit查找，返回第一個可以切分出size的空閒節點
+    size_t find_first_fit(size_t size, uint8_t &level) const noexcept;
+    //! 在鎖內從find_first_fit的結果切分出size，候選節點失效時返回npos
+    size_t commit_node(size_t index, uint8_t &level, size_t size,
+                       uint64_t version);
+    //! 只在root為根的條帶中first_fit
+    size_t take_stripe_node(size_t size, size_t root, uint8_t &level);
+    void *alloc_in_stripes(size_t size, size_t alignment,
+                           size_t &alloced_size);
+    //! 從index往下找包含offset的已分配節點並釋放
+    bool release_offset(size_t offset, size_t index, uint8_t level,
+                        size_t &freed_size);
+    //! offset不在條帶之上的大節點中時在條帶內釋放，否則返回空
+    std::optional<bool> free_in_stripe(size_t offset, size_t &freed_size);
+    //! 條帶之上兄弟都空閒的節點合併，給大分配用
+    void merge_stripes() noexcept;
+    //! 重新切分條帶之上的空閒節點
+    void restore_stripes() noexcept;
+    //! 空閒的兄弟都合併後子樹中最大的空閒節點所在的層。
+    //! 分條帶時只看條帶之上
+    uint8_t merged_free_level(size_t index, uint8_t level) const noexcept;
+    //! 是否可能有沒合併的空閒兄弟節點
+    bool keeps_unmerged() const noexcept {
+      return std::atomic_ref(unmerged_num).load(std::memory_order_relaxed) !=
+             0;
+    }
+    void split_node(size_t index, uint8_t level) noexcept;
+    //! 第level層最左的可達空閒節點
+    size_t find_free_node(uint8_t level) const;
+    void rebuild_summary() noexcept;
+    void combine(size_t index, uint8_t level) noexcept;
+    void release_node(size_t index, uint8_t level) noexcept;
+    //! first_fit在offset分配了level層的節點
+    void advance_hints(size_t offset, uint8_t level) noexcept;
+    //! 從offset開始出現了level層及更小的可用節點
+    void lower_hints(size_t offset, uint8_t level) noexcept;
+    void reset_hints() noexcept;
+    //! 合併所有延遲的兄弟節點，有合併時返回true
+    bool merge_deferred_nodes();
+    //! 子樹中最大的空閒節點所在的層，沒有時是index_none
+    uint8_t subtree_free_level(size_t index, uint8_t level) const noexcept;
+    uint64_t compute_index_word(size_t index, uint8_t level) const noexcept;
+    //! index的狀態改變後更新它和祖先的索引字，changed_level之上的節點
+    //! 狀態沒有變，索引字不變時可以提前結束
+    void update_index(size_t index, uint8_t level,
+                      uint8_t changed_level) noexcept;
+    void rebuild_index() noexcept;
     node_status get_node_status(size_t index) const noexcept;
     void set_node_status(size_t index, node_status status) noexcept;
     static size_t left_child_index(size_t index) { return index * 2 + 1; }
     static size_t right_child_index(size_t index) { return index * 2 + 2; }
     static size_t parent_index(size_t index) { return (index + 1) / 2 - 1; }
-    static size_t sibling_index(size_t index) { return index + (index & 1); }
+    static size_t sibling_index(size_t index) {
+      return (index & 1) ? index + 1 : index - 1;
+    }
+    //! 分條帶時不同條帶並發修改統計，用原子操作
+    static size_t load_count(size_t &counter) {
+      return std::atomic_ref(counter).load(std::memory_order_relaxed);
+    }
+    void add_count(size_t &counter, size_t delta) const noexcept {
+      if (stripe_level.load(std::memory_order_relaxed) != 0) {
+        std::atomic_ref(counter).fetch_add(delta, std::memory_order_relaxed);
+      } else {
+        counter += delta;
+      }
+    }
+    void sub_count(size_t &counter, size_t delta) const noexcept {
+      if (stripe_level.load(std::memory_order_relaxed) != 0) {
+        std::atomic_ref(counter).fetch_sub(delta, std::memory_order_relaxed);
+      } else {
+        counter -= delta;
+      }
+    }
 
-  
-    size_t used_size{};
+    shared_state own_state{};
+    size_t &used_size;
+    //! 每一層可分配(unused且可達)的節點數
+    std::array<size_t, 33> &free_node_num;
     uint8_t max_level{28};
     uint8_t *tree{nullptr};
     void *data{nullptr};
-    mutable std::shared_timed_mutex alloc_mutex;
+    mutable instrumented_mutex<allocator_mutex> alloc_mutex;
     alloc_location data_location;
+    uint32_t block_id{};
+    std::atomic<fit_policy> policy{fit_policy::first_fit};
+    bool external_memory{false};
+    size_t max_deferred_num{0};
+    //! presplit保留的每層空閒節點數，釋放時合併不會使空閒節點少於它
+    std::array<size_t, 33> presplit_num{};
+    bool presplit_active{false};
+    //! 延遲合併和presplit留下的空閒節點數，只增不減，合併整棵樹後清零。
+    //! 為0時分配失敗不必遍歷樹合併，largest_free也不必按合併後計算
+    mutable size_t unmerged_num{0};
+    //! 每層的查找起點，這個偏移之前沒有這一層可分配的位置。
+    //! 共享內存中的塊可能被其他進程釋放，始終從0開始。樂觀查找不加鎖讀取
+    std::array<std::atomic<size_t>, 33> search_hint{};
+    //! 每層的查找起點，這個偏移之前沒有恰好在這一層的空閒節點。
+    //! best_fit據此跳過左邊的子樹，切分和合併時降低
+    std::array<std::atomic<size_t>, 33> free_hint{};
+    //! 非空時用tlsf代替樹分配，樹保持全部空閒
+    std::unique_ptr<tlsf> tlsf_engine;
+    //! 8叉索引，字節i是第i個後代的子樹中最大空閒節點的層
+    static constexpr uint8_t index_none{0xFF};
+    std::vector<uint64_t> index_words;
+    //! 有索引字的層到下一個索引層的距離，0表示這一層沒有索引字
+    std::array<uint8_t, 33> index_height{};
+    std::array<size_t, 33> index_word_base{};
+    //! 條帶根節點所在的層，0表示不分條帶。只在持有獨佔鎖時修改
+    std::atomic<uint8_t> stripe_level{0};
+    struct alignas(64) stripe_lock {
+      std::mutex mutex;
+    };
+    std::unique_ptr<stripe_lock[]> stripe_locks;
+    std::atomic<bool> optimistic{false};
+    //! 持有獨佔鎖修改樹後加1，樂觀查找據此判斷查找期間樹是否被修改
+    std::atomic<uint64_t> tree_version{0};
   };
 
 } // namespace cuda_buddy
@@ -0,0 +1,132 @@
+/*!
+ * \file allocator_mutex.cpp
+ *
+ * \brief allocator使用的鎖
+ * \date 2026-10-17
+ */
+
+#include <cerrno>
+#include <linux/futex.h>
+#include <spdlog/spdlog.h>
+#include <sys/syscall.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+
+#include "allocator_mutex.hpp"
+
+namespace cuda_buddy {
+
+  void allocator_mutex::init_process_mutex(pthread_mutex_t *mutex) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    auto res = pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (res != 0) {
+      throw std::system_error(res, std::generic_category(),
+                              "pthread_mutex_init");
+    }
+  }
+
+  void allocator_mutex::lock_process_mutex() {
+    auto res = pthread_mutex_lock(process_mutex);
+    if (res == EOWNERDEAD) {
+      recover();
+      return;
+    }
+    if (res != 0) {
+      throw std::system_error(res, std::generic_category(),
+                              "pthread_mutex_lock");
+    }
+  }
+
+  namespace {
+    //! 退避的最大自旋次數，超過後每輪讓出CPU
+    constexpr uint32_t max_spin_backoff{1024};
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t));
+
+    inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+#elif defined(__aarch64__)
+      asm volatile("yield");
+#endif
+    }
+  } // namespace
+
+  bool allocator_mutex::set_policy(lock_policy policy_) {
+    if (process_mutex && policy_ != lock_policy::shared) {
+      return false;
+    }
+    mutex_policy = policy_;
+    return true;
+  }
+
+  bool allocator_mutex::try_lock() {
+    switch (mutex_policy) {
+      case lock_policy::shared:
+        break;
+      case lock_policy::none:
+        return true;
+      case lock_policy::spin:
+        return !spin_flag.load(std::memory_order_relaxed) &&
+               !spin_flag.exchange(true, std::memory_order_acquire);
+      case lock_policy::futex: {
+        uint32_t unlocked = 0;
+        return futex_state.compare_exchange_strong(
+            unlocked, 1, std::memory_order_acquire, std::memory_order_relaxed);
+      }
+    }
+    if (!process_mutex) {
+      return mutex.try_lock();
+    }
+    auto res = pthread_mutex_trylock(process_mutex);
+    if (res == EOWNERDEAD) {
+      recover();
+      return true;
+    }
+    return res == 0;
+  }
+
+  void allocator_mutex::lock_spin() {
+    uint32_t backoff = 1;
+    do {
+      //只讀等待，避免exchange在持有者的cache line上來回搶佔
+      while (spin_flag.load(std::memory_order_relaxed)) {
+        if (backoff > max_spin_backoff) {
+          std::this_thread::yield();
+          continue;
+        }
+        for (uint32_t i = 0; i < backoff; i++) {
+          cpu_relax();
+        }
+        backoff *= 2;
+      }
+    } while (spin_flag.exchange(true, std::memory_order_acquire));
+  }
+
+  void allocator_mutex::lock_futex() {
+    //進入等待前把狀態改成2，解鎖的線程據此知道需要喚醒
+    auto state = futex_state.exchange(2, std::memory_order_acquire);
+    while (state != 0) {
+      syscall(SYS_futex, reinterpret_cast<uint32_t *>(&futex_state),
+              FUTEX_WAIT_PRIVATE, 2, nullptr, nullptr, 0);
+      state = futex_state.exchange(2, std::memory_order_acquire);
+    }
+  }
+
+  void allocator_mutex::wake_futex() {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&futex_state),
+            FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+  }
+
+  void allocator_mutex::recover() {
+    spdlog::warn("owner of allocator mutex died, recovering");
+    if (recovery) {
+      recovery();
+    }
+    pthread_mutex_consistent(process_mutex);
+  }
+} // namespace cuda_buddy
@@ -0,0 +1,139 @@
+/*!
+ * \file allocator_mutex.hpp
+ *
+ * \brief allocator使用的鎖
+ * \date 2026-10-17
+ */
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <pthread.h>
+#include <shared_mutex>
+
+namespace cuda_buddy {
+
+  //! 進程內鎖的實現
+  /*!
+   * shared是讀寫鎖(默認)，條帶鎖需要它的共享模式。none不加鎖，只用於
+   * 被一個線程獨佔的塊。spin在臨界區很短時避免睡眠，等待時指數退避，
+   * 退避到上限後讓出CPU。futex是三態互斥鎖，沒有爭用時加鎖和解鎖各一次
+   * 原子操作。除shared外lock_shared等同lock。
+   */
+  enum class lock_policy : uint8_t { shared = 0, none, spin, futex };
+
+  //! 默認是進程內的讀寫鎖，也可以指向共享內存中的進程間鎖
+  /*!
+   * 進程間鎖是robust的，持有鎖的進程死掉後，下一個加鎖的進程調用
+   * 恢復函數修復受保護的狀態。進程間鎖沒有共享模式，lock_shared等同lock。
+   * 進程內鎖按lock_policy選擇實現。
+   */
+  class allocator_mutex final {
+  public:
+    allocator_mutex() = default;
+    explicit allocator_mutex(pthread_mutex_t *process_mutex_)
+        : process_mutex(process_mutex_) {}
+
+    allocator_mutex(const allocator_mutex &) = delete;
+    allocator_mutex &operator=(const allocator_mutex &) = delete;
+
+    //! 在共享內存中初始化進程間鎖
+    static void init_process_mutex(pthread_mutex_t *mutex);
+
+    void set_recovery(std::function<void()> recovery_) {
+      recovery = std::move(recovery_);
+    }
+
+    //! 只在沒有線程持有或等待鎖時切換，進程間鎖不能切換
+    bool set_policy(lock_policy policy_);
+    lock_policy policy() const { return mutex_policy; }
+
+    void lock() {
+      switch (mutex_policy) {
+        case lock_policy::shared:
+          if (process_mutex) {
+            lock_process_mutex();
+            return;
+          }
+          mutex.lock();
+          return;
+        case lock_policy::none:
+          return;
+        case lock_policy::spin:
+          if (!spin_flag.exchange(true, std::memory_order_acquire)) {
+            return;
+          }
+          lock_spin();
+          return;
+        case lock_policy::futex:
+          if (uint32_t unlocked = 0; futex_state.compare_exchange_strong(
+                  unlocked, 1, std::memory_order_acquire,
+                  std::memory_order_relaxed)) {
+            return;
+          }
+          lock_futex();
+          return;
+      }
+    }
+    bool try_lock();
+    void unlock() {
+      switch (mutex_policy) {
+        case lock_policy::shared:
+          if (process_mutex) {
+            pthread_mutex_unlock(process_mutex);
+            return;
+          }
+          mutex.unlock();
+          return;
+        case lock_policy::none:
+          return;
+        case lock_policy::spin:
+          spin_flag.store(false, std::memory_order_release);
+          return;
+        case lock_policy::futex:
+          //狀態2表示可能有等待者，需要喚醒一個
+          if (futex_state.exchange(0, std::memory_order_release) == 2) {
+            wake_futex();
+          }
+          return;
+      }
+    }
+    void lock_shared() {
+      if (mutex_policy != lock_policy::shared || process_mutex) {
+        lock();
+        return;
+      }
+      mutex.lock_shared();
+    }
+    bool try_lock_shared() {
+      if (mutex_policy != lock_policy::shared || process_mutex) {
+        return try_lock();
+      }
+      return mutex.try_lock_shared();
+    }
+    void unlock_shared() {
+      if (mutex_policy != lock_policy::shared || process_mutex) {
+        unlock();
+        return;
+      }
+      mutex.unlock_shared();
+    }
+
+  private:
+    void lock_process_mutex();
+    void recover();
+    void lock_spin();
+    void lock_futex();
+    void wake_futex();
+
+  private:
+    std::shared_mutex mutex;
+    pthread_mutex_t *process_mutex{nullptr};
+    std::function<void()> recovery;
+    lock_policy mutex_policy{lock_policy::shared};
+    std::atomic<bool> spin_flag{false};
+    //! 0未加鎖，1加鎖且沒有等待者，2加鎖且可能有等待者
+    std::atomic<uint32_t> futex_state{0};
+  };
+} // namespace cuda_buddy
@@ -0,0 +1,30 @@
+/*!
+ * \file cuda_check.hpp
+ *
+ * \brief 檢查CUDA調用的返回值
+ * \date 2026-10-17
+ */
+#pragma once
+
+#include <cstdlib>
+#include <cuda_runtime.h>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <string>
+
+namespace cuda_buddy {
+  // CUDA: various checks for different function calls.
+  inline void cuda_check(cudaError_t error, const std::string &operation,
+                         bool do_abort) {
+    if (error != cudaSuccess && error != cudaErrorCudartUnloading) {
+      std::string err_str(operation + " failed:");
+      err_str += cudaGetErrorString(error);
+      if (do_abort) {
+        spdlog::error("{}", err_str);
+        abort();
+      } else {
+        throw std::runtime_error(err_str);
+      }
+    }
+  }
+} // namespace cuda_buddy
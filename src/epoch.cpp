@@ -0,0 +1,86 @@
+/*!
+ * \file epoch.cpp
+ *
+ * \brief 基於紀元的延遲回收，讀者不加鎖訪問會被整體替換的數據
+ * \date 2026-10-17
+ */
+
+#include <atomic>
+#include <thread>
+
+#include "epoch.hpp"
+
+namespace cuda_buddy {
+
+  namespace {
+    struct alignas(64) reader_slot final {
+      //! 讀區間開始時的全局紀元，0表示不在讀區間中
+      std::atomic<uint64_t> active_epoch{0};
+      std::atomic<bool> in_use{false};
+      //! 加入鏈表後不再修改
+      reader_slot *next{nullptr};
+    };
+
+    std::atomic<uint64_t> global_epoch{1};
+    //! 只增加不刪除，線程退出後槽位留給新線程複用
+    std::atomic<reader_slot *> slots{nullptr};
+
+    reader_slot *acquire_slot() {
+      for (auto slot = slots.load(); slot; slot = slot->next) {
+        bool unused = false;
+        if (!slot->in_use.load(std::memory_order_relaxed) &&
+            slot->in_use.compare_exchange_strong(unused, true)) {
+          return slot;
+        }
+      }
+      auto slot = new reader_slot;
+      slot->in_use.store(true, std::memory_order_relaxed);
+      slot->next = slots.load(std::memory_order_relaxed);
+      while (!slots.compare_exchange_weak(slot->next, slot)) {
+      }
+      return slot;
+    }
+
+    struct local_reader final {
+      local_reader() : slot(acquire_slot()) {}
+      ~local_reader() { slot->in_use.store(false); }
+      local_reader(const local_reader &) = delete;
+      local_reader &operator=(const local_reader &) = delete;
+
+      reader_slot *slot;
+      uint32_t depth{0};
+    };
+
+    thread_local local_reader reader;
+  } // namespace
+
+  epoch::guard::guard() {
+    //槽位的寫入和之後讀取被保護的指針都是seq_cst，synchronize要麼看到
+    //這個讀者，要麼這個讀者看到替換後的數據
+    if (reader.depth++ == 0) {
+      reader.slot->active_epoch.store(global_epoch.load());
+    }
+  }
+
+  epoch::guard::~guard() {
+    if (--reader.depth == 0) {
+      reader.slot->active_epoch.store(0, std::memory_order_release);
+    }
+  }
+
+  void epoch::synchronize() {
+    auto target = global_epoch.fetch_add(1) + 1;
+    for (auto slot = slots.load(); slot; slot = slot->next) {
+      while (true) {
+        auto active = slot->active_epoch.load();
+        if (active == 0 || active >= target) {
+          break;
+        }
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  uint64_t epoch::current() { return global_epoch.load(); }
+
+} // namespace cuda_buddy
@@ -0,0 +1,38 @@
+/*!
+ * \file epoch.hpp
+ *
+ * \brief 基於紀元的延遲回收，讀者不加鎖訪問會被整體替換的數據
+ * \date 2026-10-17
+ */
+#pragma once
+
+#include <cstdint>
+
+namespace cuda_buddy {
+
+  //! 讀者登記進入時的紀元，寫者替換數據後等舊的讀者全部離開再回收
+  /*!
+   * 每個線程在自己的cache line上有一個槽位，進入和離開讀區間只寫這個
+   * 槽位，不寫任何共享的cache line。synchronize推進全局紀元，等待推進
+   * 之前進入的讀區間全部結束，之後調用者可以釋放被替換下來的數據。
+   * 讀區間可以嵌套，讀區間中不能調用synchronize，也不能等待會調用
+   * synchronize的線程持有的鎖。
+   */
+  class epoch final {
+  public:
+    class guard final {
+    public:
+      guard();
+      ~guard();
+
+      guard(const guard &) = delete;
+      guard &operator=(const guard &) = delete;
+    };
+
+    //! 等待調用之前開始的讀區間全部結束
+    static void synchronize();
+    //! 當前的全局紀元，用於測試
+    static uint64_t current();
+  };
+
+} // namespace cuda_buddy
@@ -0,0 +1,187 @@
+/*!
+ * \file host_region.cpp
+ *
+ * \brief 放在具名共享內存中的host塊，可以在進程間共享，進程重啓後可以重新掛接
+ * \date 2026-10-17
+ */
+
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+
+#include "cuda_check.hpp"
+#include "host_region.hpp"
+
+namespace cuda_buddy {
+
+  namespace {
+    constexpr uint64_t region_magic = 0x7964647562616475ULL;
+    constexpr uint32_t region_version = 2;
+    constexpr size_t page_size = 4096;
+
+    std::system_error errno_error(const std::string &operation) {
+      return std::system_error(errno, std::generic_category(), operation);
+    }
+  } // namespace
+
+  struct host_region::header final {
+    //! 創建者初始化完其他部分後才寫入
+    std::atomic<uint64_t> magic;
+    uint32_t version;
+    uint32_t block_level;
+    uint64_t block_num;
+    //! 當前映射了這個區域的進程數
+    std::atomic<uint32_t> attach_count;
+  };
+
+  host_region::host_region(std::string name_, size_t block_num_,
+                           bool pin_memory)
+      : name(std::move(name_)) {
+    static_assert(sizeof(header) <= page_size);
+    state_size = (block_num_ * sizeof(allocator::shared_state) + page_size -
+                  1) /
+                 page_size * page_size;
+    mapped_size = page_size + state_size +
+                  block_num_ * (allocator::tree_size(block_level) +
+                                (1ULL << block_level));
+
+    auto fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    is_restored = fd < 0;
+    if (is_restored) {
+      if (errno != EEXIST) {
+        throw errno_error("shm_open " + name);
+      }
+      fd = shm_open(name.c_str(), O_RDWR, 0600);
+      if (fd < 0) {
+        throw errno_error("shm_open " + name);
+      }
+      //創建者可能還沒有調用ftruncate
+      struct stat st {};
+      for (int i = 0; i < 100; i++) {
+        if (fstat(fd, &st) != 0) {
+          auto err = errno_error("fstat " + name);
+          close(fd);
+          throw err;
+        }
+        if (st.st_size != 0) {
+          break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      if (static_cast<size_t>(st.st_size) != mapped_size) {
+        close(fd);
+        throw std::runtime_error("size of shared memory " + name +
+                                 " doesn't match block number");
+      }
+    } else if (ftruncate(fd, static_cast<off_t>(mapped_size)) != 0) {
+      // ftruncate得到的內存是零，也就是所有樹節點都是unused
+      auto err = errno_error("ftruncate " + name);
+      close(fd);
+      shm_unlink(name.c_str());
+      throw err;
+    }
+    auto ptr = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+      throw errno_error("mmap " + name);
+    }
+    base = static_cast<uint8_t *>(ptr);
+    hdr = reinterpret_cast<header *>(base);
+    states = reinterpret_cast<allocator::shared_state *>(base + page_size);
+
+    if (is_restored) {
+      for (int i = 0; i < 100 && hdr->magic.load() != region_magic; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      if (hdr->magic.load() != region_magic ||
+          hdr->version != region_version || hdr->block_level != block_level ||
+          hdr->block_num != block_num_) {
+        munmap(base, mapped_size);
+        throw std::runtime_error("shared memory " + name +
+                                 " has incompatible layout");
+      }
+      spdlog::debug("attach to shared memory {}, {} processes attached", name,
+                    hdr->attach_count.load());
+    } else {
+      hdr->version = region_version;
+      hdr->block_level = block_level;
+      hdr->block_num = block_num_;
+      for (size_t i = 0; i < block_num_; i++) {
+        allocator::init_shared_state(states[i]);
+      }
+      hdr->magic.store(region_magic);
+    }
+    hdr->attach_count++;
+
+    if (pin_memory) {
+      try {
+        cuda_check(cudaHostRegister(base, mapped_size, cudaHostRegisterDefault),
+                   "cudaHostRegister", false);
+      } catch (...) {
+        hdr->attach_count--;
+        munmap(base, mapped_size);
+        throw;
+      }
+      pinned = true;
+    }
+  }
+
+  host_region::~host_region() {
+    if (pinned) {
+      cuda_check(cudaHostUnregister(base), "cudaHostUnregister", true);
+    }
+    hdr->attach_count--;
+    if (munmap(base, mapped_size) != 0) {
+      spdlog::error(
+          "munmap failed:{}",
+          std::make_error_code(static_cast<std::errc>(errno)).message());
+    }
+  }
+
+  std::unique_ptr<host_region> host_region::open(std::string name_,
+                                                 size_t block_num_,
+                                                 bool pin_memory) noexcept {
+    try {
+      return std::make_unique<host_region>(std::move(name_), block_num_,
+                                           pin_memory);
+    } catch (const std::exception &e) {
+      spdlog::error("open host region failed:{}", e.what());
+    }
+    return {};
+  }
+
+  bool host_region::remove(const std::string &name) {
+    return shm_unlink(name.c_str()) == 0;
+  }
+
+  size_t host_region::block_num() const { return hdr->block_num; }
+
+  size_t host_region::offset_of(const void *ptr) const {
+    return static_cast<const uint8_t *>(ptr) - base;
+  }
+
+  void *host_region::address_of(size_t offset) const { return base + offset; }
+
+  size_t host_region::block_offset(size_t block_no) const {
+    return page_size + state_size + block_no * (allocator::tree_size(block_level) +
+                                   (1ULL << block_level));
+  }
+
+  std::unique_ptr<allocator> host_region::make_block(size_t block_no) const {
+    if (block_no >= block_num()) {
+      return {};
+    }
+    auto tree = base + block_offset(block_no);
+    return std::make_unique<allocator>(
+        block_level, tree, tree + allocator::tree_size(block_level),
+        states[block_no], static_cast<uint32_t>(block_no));
+  }
+} // namespace cuda_buddy
@@ -0,0 +1,71 @@
+/*!
+ * \file host_region.hpp
+ *
+ * \brief 放在具名共享內存中的host塊，可以在進程間共享，進程重啓後可以重新掛接
+ * \date 2026-10-17
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "allocator.hpp"
+
+namespace cuda_buddy {
+
+  //! 具名共享內存(shm_open)中的一組buddy塊
+  /*!
+   * 每個塊的數據、allocator的樹、統計和進程間鎖都放在共享內存中。
+   * 多個進程打開同名的區域時共用這些塊，各自用pool(host_region&)分配，
+   * 通過offset_of/address_of交換緩沖區。所有進程退出後重新打開時
+   * 恢復上次的分配狀態，只需要重新cudaHostRegister。pin_memory為false時
+   * 不調用CUDA，可以在沒有GPU的機器上使用。
+   * 析構時只解除映射，共享內存保留到remove為止。
+   */
+  class host_region final {
+  public:
+    host_region(std::string name_, size_t block_num_, bool pin_memory = true);
+
+    host_region(const host_region &) = delete;
+    host_region &operator=(const host_region &) = delete;
+
+    host_region(host_region &&rhs) = delete;
+    host_region &operator=(host_region &&rhs) = delete;
+
+    ~host_region();
+
+    static bool remove(const std::string &name);
+    //! 不拋異常的版本，失敗時記錄錯誤並返回空指針
+    static std::unique_ptr<host_region>
+    open(std::string name_, size_t block_num_, bool pin_memory = true) noexcept;
+
+    //! 是否是從已有的共享內存恢復的
+    bool restored() const { return is_restored; }
+    size_t block_num() const;
+    std::unique_ptr<allocator> make_block(size_t block_no) const;
+
+    //! 相對於區域起始的偏移，在各個進程中都有效
+    size_t offset_of(const void *ptr) const;
+    void *address_of(size_t offset) const;
+
+  public:
+    static constexpr uint8_t block_level{28};
+
+  private:
+    struct header;
+    size_t block_offset(size_t block_no) const;
+
+  private:
+    std::string name;
+    size_t mapped_size{};
+    size_t state_size{};
+    uint8_t *base{nullptr};
+    header *hdr{nullptr};
+    allocator::shared_state *states{nullptr};
+    bool pinned{false};
+    bool is_restored{false};
+  };
+
+} // namespace cuda_buddy
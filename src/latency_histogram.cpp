@@ -0,0 +1,152 @@
+/*!
+ * \file latency_histogram.cpp
+ *
+ * \brief 分配和釋放的延遲直方圖
+ * \date 2026-10-17
+ */
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "latency_histogram.hpp"
+
+namespace cuda_buddy {
+
+  namespace {
+    struct thread_histogram final {
+      //! 只由所屬線程寫入，用relaxed讀寫避免加鎖的原子加
+      std::array<std::array<std::atomic<uint64_t>,
+                            latency_histogram::bucket_num>,
+                 latency_histogram::operation_num>
+          counts{};
+      std::array<std::atomic<uint64_t>, latency_histogram::operation_num>
+          total_ns{};
+    };
+
+    std::mutex histogram_mutex;
+    //! 線程退出後保留它的桶，讀取時照樣合併
+    std::vector<std::shared_ptr<thread_histogram>> histograms;
+
+#ifndef CUDA_BUDDY_DISABLE_LATENCY_HISTOGRAM
+    thread_local std::shared_ptr<thread_histogram> local_histogram;
+
+    thread_histogram &get_local_histogram() {
+      if (!local_histogram) {
+        local_histogram = std::make_shared<thread_histogram>();
+        std::lock_guard lk(histogram_mutex);
+        histograms.push_back(local_histogram);
+      }
+      return *local_histogram;
+    }
+
+    void increase(std::atomic<uint64_t> &counter, uint64_t value) {
+      counter.store(counter.load(std::memory_order_relaxed) + value,
+                    std::memory_order_relaxed);
+    }
+#endif
+  } // namespace
+
+  size_t latency_histogram::bucket_index(uint64_t latency_ns) {
+    if (latency_ns < sub_bucket_num) {
+      return latency_ns;
+    }
+    auto exponent = static_cast<size_t>(std::bit_width(latency_ns) - 1);
+    auto sub_bucket =
+        (latency_ns >> (exponent - sub_bucket_bits)) & (sub_bucket_num - 1);
+    return (exponent - sub_bucket_bits + 1) * sub_bucket_num + sub_bucket;
+  }
+
+  uint64_t latency_histogram::bucket_lower_bound(size_t index) {
+    if (index < sub_bucket_num) {
+      return index;
+    }
+    auto exponent = index / sub_bucket_num + sub_bucket_bits - 1;
+    auto sub_bucket = index % sub_bucket_num;
+    return (sub_bucket_num + sub_bucket) << (exponent - sub_bucket_bits);
+  }
+
+  uint64_t latency_histogram::bucket_upper_bound(size_t index) {
+    if (index < sub_bucket_num) {
+      return index;
+    }
+    auto exponent = index / sub_bucket_num + sub_bucket_bits - 1;
+    return bucket_lower_bound(index) +
+           ((1ULL << (exponent - sub_bucket_bits)) - 1);
+  }
+
+#ifndef CUDA_BUDDY_DISABLE_LATENCY_HISTOGRAM
+  void latency_histogram::record(operation op, uint64_t latency_ns) {
+    auto &histogram = get_local_histogram();
+    auto op_index = static_cast<size_t>(op);
+    increase(histogram.counts[op_index][bucket_index(latency_ns)], 1);
+    increase(histogram.total_ns[op_index], latency_ns);
+  }
+#endif
+
+  void latency_histogram::reset() {
+    std::lock_guard lk(histogram_mutex);
+    for (auto const &histogram : histograms) {
+      for (auto &counts : histogram->counts) {
+        for (auto &count : counts) {
+          count.store(0, std::memory_order_relaxed);
+        }
+      }
+      for (auto &total : histogram->total_ns) {
+        total.store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  latency_histogram::snapshot latency_histogram::get(operation op) {
+    snapshot res{};
+    auto op_index = static_cast<size_t>(op);
+    {
+      std::lock_guard lk(histogram_mutex);
+      for (auto const &histogram : histograms) {
+        for (size_t i = 0; i < bucket_num; i++) {
+          res.counts[i] +=
+              histogram->counts[op_index][i].load(std::memory_order_relaxed);
+        }
+        res.total_ns +=
+            histogram->total_ns[op_index].load(std::memory_order_relaxed);
+      }
+    }
+    for (size_t i = 0; i < bucket_num; i++) {
+      if (res.counts[i] == 0) {
+        continue;
+      }
+      if (res.count == 0) {
+        res.min_ns = bucket_lower_bound(i);
+      }
+      res.count += res.counts[i];
+      res.max_ns = bucket_upper_bound(i);
+    }
+    return res;
+  }
+
+  uint64_t latency_histogram::snapshot::value_at_percentile(
+      double percentile) const {
+    if (count == 0) {
+      return 0;
+    }
+    percentile = std::clamp(percentile, 0.0, 100.0);
+    auto rank = std::max<uint64_t>(
+        1, static_cast<uint64_t>(std::ceil(percentile / 100 * count)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < bucket_num; i++) {
+      seen += counts[i];
+      if (seen >= rank) {
+        return std::min(bucket_upper_bound(i), max_ns);
+      }
+    }
+    return max_ns;
+  }
+
+  double latency_histogram::snapshot::mean_ns() const {
+    return count == 0 ? 0 : static_cast<double>(total_ns) / count;
+  }
+} // namespace cuda_buddy
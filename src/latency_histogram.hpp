@@ -0,0 +1,77 @@
+/*!
+ * \file latency_histogram.hpp
+ *
+ * \brief 分配和釋放的延遲直方圖
+ * \date 2026-10-17
+ */
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace cuda_buddy {
+
+  //! HDR風格的對數-線性延遲直方圖
+  /*!
+   * 每個2的冪區間再等分成32個桶，相對誤差不超過1/32。
+   * enable之後各線程寫自己的桶，讀取時合併所有線程。
+   * 定義CUDA_BUDDY_DISABLE_LATENCY_HISTOGRAM時enabled()恒為false，
+   * 記錄點被編譯器消除；未enable時每個記錄點只有一次relaxed讀取。
+   */
+  class latency_histogram final {
+  public:
+    enum class operation : uint8_t {
+      pool_alloc = 0,
+      pool_free,
+      allocator_alloc,
+      get_block,
+    };
+    static constexpr size_t operation_num{4};
+
+    static constexpr size_t sub_bucket_bits{5};
+    static constexpr size_t sub_bucket_num{1ULL << sub_bucket_bits};
+    static constexpr size_t bucket_num{(64 - sub_bucket_bits + 1) *
+                                       sub_bucket_num};
+
+    //! 合併後的直方圖
+    struct snapshot final {
+      std::array<uint64_t, bucket_num> counts;
+      uint64_t count;
+      //! 最小和最大值只精確到所在的桶
+      uint64_t min_ns;
+      uint64_t max_ns;
+      uint64_t total_ns;
+
+      //! percentile在0到100之間，返回所在桶的上界(不超過max_ns)
+      uint64_t value_at_percentile(double percentile) const;
+      double mean_ns() const;
+    };
+
+#ifdef CUDA_BUDDY_DISABLE_LATENCY_HISTOGRAM
+    static constexpr bool enabled() { return false; }
+    static void enable() {}
+    static void disable() {}
+    static void record(operation, uint64_t) {}
+#else
+    static bool enabled() { return active.load(std::memory_order_relaxed); }
+    static void enable() { active.store(true); }
+    static void disable() { active.store(false); }
+    static void record(operation op, uint64_t latency_ns);
+#endif
+    //! 清空所有線程的桶
+    static void reset();
+    static snapshot get(operation op);
+
+    static size_t bucket_index(uint64_t latency_ns);
+    static uint64_t bucket_lower_bound(size_t index);
+    static uint64_t bucket_upper_bound(size_t index);
+
+  private:
+#ifndef CUDA_BUDDY_DISABLE_LATENCY_HISTOGRAM
+    static inline std::atomic<bool> active{false};
+#endif
+  };
+
+} // namespace cuda_buddy
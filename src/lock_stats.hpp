@@ -0,0 +1,174 @@
+/*!
+ * \file lock_stats.hpp
+ *
+ * \brief 鎖的等待和持有時間統計
+ * \date 2026-10-17
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <utility>
+
+namespace cuda_buddy {
+
+  //! 統計的全局開關和每個鎖的計數
+  /*!
+   * enable之後加鎖先try_lock，失敗才計時等待時間，所以沒有爭用時只多一次
+   * 原子加。持有時間只統計獨佔鎖。定義CUDA_BUDDY_DISABLE_LOCK_STATS時
+   * enabled()恒為false，instrumented_mutex的統計分支被編譯器消除。
+   */
+  class lock_stats final {
+  public:
+    struct snapshot {
+      uint64_t acquire_count;
+      //! try_lock失敗、需要等待的次數
+      uint64_t contended_count;
+      uint64_t wait_ns;
+      uint64_t max_wait_ns;
+      uint64_t exclusive_count;
+      uint64_t hold_ns;
+    };
+
+#ifdef CUDA_BUDDY_DISABLE_LOCK_STATS
+    static constexpr bool enabled() { return false; }
+    static void enable() {}
+    static void disable() {}
+#else
+    static bool enabled() { return active.load(std::memory_order_relaxed); }
+    static void enable() { active.store(true); }
+    static void disable() { active.store(false); }
+#endif
+
+    static uint64_t now_ns() {
+      return static_cast<uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now().time_since_epoch())
+              .count());
+    }
+
+    snapshot get() const {
+      return {acquire_count.load(std::memory_order_relaxed),
+              contended_count.load(std::memory_order_relaxed),
+              wait_ns.load(std::memory_order_relaxed),
+              max_wait_ns.load(std::memory_order_relaxed),
+              exclusive_count.load(std::memory_order_relaxed),
+              hold_ns.load(std::memory_order_relaxed)};
+    }
+    void reset() {
+      acquire_count.store(0, std::memory_order_relaxed);
+      contended_count.store(0, std::memory_order_relaxed);
+      wait_ns.store(0, std::memory_order_relaxed);
+      max_wait_ns.store(0, std::memory_order_relaxed);
+      exclusive_count.store(0, std::memory_order_relaxed);
+      hold_ns.store(0, std::memory_order_relaxed);
+    }
+
+    void acquired() { acquire_count.fetch_add(1, std::memory_order_relaxed); }
+    void waited(uint64_t ns) {
+      acquire_count.fetch_add(1, std::memory_order_relaxed);
+      contended_count.fetch_add(1, std::memory_order_relaxed);
+      wait_ns.fetch_add(ns, std::memory_order_relaxed);
+      auto prev = max_wait_ns.load(std::memory_order_relaxed);
+      while (prev < ns && !max_wait_ns.compare_exchange_weak(
+                              prev, ns, std::memory_order_relaxed)) {
+      }
+    }
+    void held(uint64_t ns) {
+      exclusive_count.fetch_add(1, std::memory_order_relaxed);
+      hold_ns.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+  private:
+#ifndef CUDA_BUDDY_DISABLE_LOCK_STATS
+    static inline std::atomic<bool> active{false};
+#endif
+    std::atomic<uint64_t> acquire_count{0};
+    std::atomic<uint64_t> contended_count{0};
+    std::atomic<uint64_t> wait_ns{0};
+    std::atomic<uint64_t> max_wait_ns{0};
+    std::atomic<uint64_t> exclusive_count{0};
+    std::atomic<uint64_t> hold_ns{0};
+  };
+
+  //! 帶統計的鎖，接口和Mutex相同，共享模式只在Mutex支持時可用
+  template <typename Mutex> class instrumented_mutex final {
+  public:
+    instrumented_mutex() = default;
+    template <typename... Args>
+    explicit instrumented_mutex(Args &&...args)
+        : mutex(std::forward<Args>(args)...) {}
+
+    instrumented_mutex(const instrumented_mutex &) = delete;
+    instrumented_mutex &operator=(const instrumented_mutex &) = delete;
+
+    void lock() {
+      if (!lock_stats::enabled()) {
+        mutex.lock();
+        return;
+      }
+      if (mutex.try_lock()) {
+        stats.acquired();
+        hold_start = lock_stats::now_ns();
+        return;
+      }
+      auto start = lock_stats::now_ns();
+      mutex.lock();
+      hold_start = lock_stats::now_ns();
+      stats.waited(hold_start - start);
+    }
+    bool try_lock() {
+      if (!mutex.try_lock()) {
+        return false;
+      }
+      if (lock_stats::enabled()) {
+        stats.acquired();
+        hold_start = lock_stats::now_ns();
+      }
+      return true;
+    }
+    void unlock() {
+      //持有期間被disable時仍然記下這一次
+      if (hold_start != 0) {
+        stats.held(lock_stats::now_ns() - hold_start);
+        hold_start = 0;
+      }
+      mutex.unlock();
+    }
+    void lock_shared() {
+      if (!lock_stats::enabled()) {
+        mutex.lock_shared();
+        return;
+      }
+      if (mutex.try_lock_shared()) {
+        stats.acquired();
+        return;
+      }
+      auto start = lock_stats::now_ns();
+      mutex.lock_shared();
+      stats.waited(lock_stats::now_ns() - start);
+    }
+    bool try_lock_shared() {
+      if (!mutex.try_lock_shared()) {
+        return false;
+      }
+      if (lock_stats::enabled()) {
+        stats.acquired();
+      }
+      return true;
+    }
+    void unlock_shared() { mutex.unlock_shared(); }
+
+    Mutex &native() { return mutex; }
+    lock_stats::snapshot statistics() const { return stats.get(); }
+    void reset_statistics() { stats.reset(); }
+
+  private:
+    Mutex mutex;
+    lock_stats stats;
+    //! 只由持有獨佔鎖的線程讀寫
+    uint64_t hold_start{0};
+  };
+
+} // namespace cuda_buddy
@@ -6,9 +6,18 @@
  * \date 2017-11-27
  */
 #include <algorithm>
+#include <bit>
+#include <fstream>
+#include <functional>
 #include <spdlog/spdlog.h>
+#include <thread>
 
+#include "epoch.hpp"
+#include "host_region.hpp"
+#include "latency_histogram.hpp"
 #include "pool.hpp"
+#include "probe.hpp"
+#include "tracer.hpp"
 
 namespace cuda_buddy {
 
@@ -20,7 +29,10 @@ namespace cuda_buddy {
     host_max_level.store((std::max)(buddy_block_level, max_level));
   }
 
-  pool::pool(int gpu_no_) : gpu_no(gpu_no_) {
+  pool::pool(int gpu_no_, block_engine engine_)
+      : gpu_no(gpu_no_), engine(engine_) {
+    init_preferred_blocks();
+    publish_blocks();
 
     if (gpu_no < 0) {
       gpu_no = -1;
@@ -38,51 +50,624 @@ namespace cuda_buddy {
     }
   }
 
-  pool::~pool() { release(); }
+  pool::pool(host_region &region_) : region(&region_) {
+    static_assert(host_region::block_level == buddy_block_level);
+    auto_lock_policy.store(false);
+    init_preferred_blocks();
+    for (size_t i = 0; i < region->block_num(); i++) {
+      add_local_block(region->make_block(i));
+    }
+    publish_blocks();
+  }
+
+  pool::~pool() {
+    auto &global_pool = get_global_pool(gpu_no);
+    if (region) {
+      //共享內存中的塊不歸還全局池，狀態留在共享內存中
+      local_pool.clear();
+      delete block_snapshot.load();
+      return;
+    }
+    if (!release()) {
+      //還在使用的塊隨pool銷毀，歸還它們佔用的塊數
+      auto block_num = local_pool.size();
+      std::lock_guard lk(global_pool.pool_mutex);
+      for (auto const &block : local_pool) {
+        global_pool.free_block_ids.push_back(block->id());
+      }
+      local_pool.clear();
+      global_pool.alloced_block_num -= block_num;
+    }
+    delete block_snapshot.load();
+    wake_waiters(global_pool);
+  }
 
   void *pool::alloc(size_t size) { return alloc(size, 1); }
 
   void *pool::alloc(size_t size, size_t alignment) {
+    auto traced = CUDA_BUDDY_PROBE_ENABLED(pool_alloc);
+    auto recorded = tracer::enabled();
+    auto timed = latency_histogram::enabled();
+    probe::timer timer(traced || recorded || timed);
+    auto ptr = alloc_impl(size, alignment, true);
+    if (!ptr) {
+      failure_count++;
+    }
+    if (timed) {
+      latency_histogram::record(latency_histogram::operation::pool_alloc,
+                                timer.elapsed_ns());
+    }
+    if (traced) {
+      CUDA_BUDDY_PROBE(pool_alloc, size, alignment, ptr, timer.elapsed_ns());
+    }
+    if (recorded) {
+      trace(tracer::event_type::alloc, timer, size,
+            reinterpret_cast<uintptr_t>(ptr));
+      trace_usage();
+    }
+    return ptr;
+  }
+
+  pool::statistics pool::get_statistics() const {
+    statistics res{};
+    res.gpu_no = gpu_no;
+    res.used_bytes = used_bytes();
+    {
+      std::shared_lock pool_lock(local_pool_mutex);
+      res.block_num = local_pool.size();
+    }
+    if (!region) {
+      res.cached_block_num = get_global_pool(gpu_no).cached_block_num();
+    }
+    auto usage = total_usage();
+    res.alloc_count = usage.alloc_count;
+    res.free_count = usage.free_count;
+    res.live_count = usage.alloc_count - usage.free_count;
+    res.failure_count = failure_count.load(std::memory_order_relaxed);
+    return res;
+  }
+
+  pool::lock_statistics pool::get_lock_statistics() const {
+    lock_statistics res{};
+    res.local_pool = local_pool_mutex.statistics();
+    if (!region) {
+      res.global_pool = get_global_pool(gpu_no).pool_mutex.statistics();
+    }
+    std::shared_lock pool_lock(local_pool_mutex);
+    for (auto const &block : local_pool) {
+      res.block_ids.push_back(block->id());
+      res.blocks.push_back(block->lock_statistics());
+    }
+    return res;
+  }
+
+  pool::occupancy_map pool::occupancy(size_t resolution) const {
+    occupancy_map map{};
+    if (resolution == 0) {
+      return map;
+    }
+    //和allocator::occupancy一樣取整
+    map.resolution = std::min<size_t>(
+        std::bit_ceil(resolution), 1ULL << buddy_block_level);
+    track_thread();
+    {
+      std::shared_lock pool_lock(local_pool_mutex);
+      map.local_block_num = local_pool.size();
+      for (auto const &block : local_pool) {
+        map.block_ids.push_back(block->id());
+        auto row = block->occupancy(map.resolution);
+        map.cells.insert(map.cells.end(), row.begin(), row.end());
+      }
+    }
+    if (!region) {
+      get_global_pool(gpu_no).append_occupancy(map);
+    }
+    return map;
+  }
+
+  bool pool::write_occupancy(const std::string &path,
+                             size_t resolution) const {
+    auto map = occupancy(resolution);
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+      spdlog::error("can't open {}", path);
+      return false;
+    }
+    out << "P5\n# gpu " << gpu_no << ", " << map.local_block_num
+        << " local blocks\n"
+        << map.resolution << ' ' << map.block_ids.size() << "\n255\n";
+    out.write(reinterpret_cast<const char *>(map.cells.data()),
+              static_cast<std::streamsize>(map.cells.size()));
+    return static_cast<bool>(out);
+  }
+
+  void pool::trace(tracer::event_type type, const probe::timer &timer,
+                   uint64_t arg0, uint64_t arg1) const {
+    tracer::record({type, gpu_no, this, timer.start_ns(), timer.elapsed_ns(),
+                    arg0, arg1});
+  }
 
+  void pool::trace_usage() const {
+    tracer::record({tracer::event_type::usage, gpu_no, this, tracer::now_ns(),
+                    0, used_bytes(), 0});
+  }
+
+  size_t pool::used_bytes() const {
+    if (!region) {
+      return total_used_size();
+    }
+    //共享區域中的塊也被其他進程使用，只能從塊的統計得出
+    size_t res = 0;
+    std::shared_lock pool_lock(local_pool_mutex);
+    for (const auto &allocator : local_pool) {
+      res += (1ULL << buddy_block_level) - allocator->free_bytes();
+    }
+    return res;
+  }
+
+  bool pool::check_alloc_size(size_t size) const {
     if (size > (1ULL << buddy_block_level)) {
       spdlog::warn("too large size {}", size);
-      return nullptr;
+      return false;
     }
 
-    if (get_max_level() == 0) {
+    if (!region && get_max_level() == 0) {
       spdlog::warn("max level is 0");
+      return false;
+    }
+    return true;
+  }
+
+  template <typename F> bool pool::alloc_in_blocks(F &&try_alloc, bool warn) {
+    while (true) {
+      //先在已有的空間中分配
+      uint64_t generation = 0;
+      {
+        epoch::guard reader;
+        auto const &list = *block_snapshot.load();
+        generation = list.generation;
+        auto block_num = list.blocks.size();
+        auto affinity = block_affinity.load(std::memory_order_relaxed);
+        auto &preferred_block = local_usage().preferred_block;
+        size_t start = 0;
+        if (affinity && block_num != 0) {
+          start = preferred_block.load(std::memory_order_relaxed) % block_num;
+        }
+        for (size_t i = 0; i < block_num; i++) {
+          auto index = start + i;
+          if (index >= block_num) {
+            index -= block_num;
+          }
+          if (try_alloc(*list.blocks[index])) {
+            if (affinity) {
+              preferred_block.store(index, std::memory_order_relaxed);
+            }
+            return true;
+          }
+        }
+      }
+      //切換鎖的過程中塊暫時不在快照中，等切換結束後重新遍歷
+      {
+        std::shared_lock pool_lock(local_pool_mutex);
+        if (block_snapshot.load()->generation != generation) {
+          continue;
+        }
+      }
+
+      auto block = get_block(warn);
+      if (!block.get()) {
+        std::shared_lock pool_lock(local_pool_mutex);
+        if (block_snapshot.load()->generation == generation) {
+          return false;
+        }
+        continue;
+      }
+
+      //在鎖內配置，鎖的實現不會和並發的切換錯開
+      std::lock_guard pool_lock(local_pool_mutex);
+      setup_block(*block);
+      add_local_block(std::move(block));
+      publish_blocks();
+    }
+  }
+
+  void pool::setup_block(allocator &block) const {
+    block.set_engine(engine);
+    block.set_fit_policy(policy.load(std::memory_order_relaxed));
+    //全局池中的塊都是立即合併的
+    if (auto num = max_deferred_num.load(std::memory_order_relaxed);
+        num != 0) {
+      block.set_lazy_coalescing(num);
+    }
+    if (wide_index.load(std::memory_order_relaxed)) {
+      block.set_wide_index(true);
+    }
+    //條帶鎖需要共享模式，先確定鎖的實現
+    block.set_lock_policy(locking());
+    if (auto num = lock_stripe_num.load(std::memory_order_relaxed);
+        num != 0) {
+      block.set_lock_stripes(num);
+    }
+    if (optimistic_search.load(std::memory_order_relaxed)) {
+      block.set_optimistic_search(true);
+    }
+    presplit_block(block);
+  }
+
+  void pool::set_fit_policy(fit_policy policy_) {
+    track_thread();
+    policy.store(policy_);
+    std::shared_lock pool_lock(local_pool_mutex);
+    for (auto const &block : local_pool) {
+      block->set_fit_policy(policy_);
+    }
+  }
+
+  void pool::set_lazy_coalescing(size_t max_deferred_num_) {
+    track_thread();
+    max_deferred_num.store(max_deferred_num_);
+    std::shared_lock pool_lock(local_pool_mutex);
+    for (auto const &block : local_pool) {
+      block->set_lazy_coalescing(max_deferred_num_);
+    }
+  }
+
+  void pool::set_wide_index(bool enable) {
+    track_thread();
+    wide_index.store(enable);
+    std::shared_lock pool_lock(local_pool_mutex);
+    for (auto const &block : local_pool) {
+      block->set_wide_index(enable);
+    }
+  }
+
+  void pool::set_lock_stripes(size_t stripe_num) {
+    track_thread();
+    lock_stripe_num.store(stripe_num);
+    //自動選擇時條帶鎖改變鎖的實現，開啓前先換成shared，關閉後再換回
+    std::lock_guard pool_lock(local_pool_mutex);
+    publish_blocks(true);
+    auto policy_ = locking();
+    for (auto const &block : local_pool) {
+      if (stripe_num == 0) {
+        block->set_lock_stripes(0);
+      }
+      block->set_lock_policy(policy_);
+      if (stripe_num != 0) {
+        block->set_lock_stripes(stripe_num);
+      }
+    }
+    publish_blocks();
+  }
+
+  void pool::set_optimistic_search(bool enable) {
+    track_thread();
+    optimistic_search.store(enable);
+    std::shared_lock pool_lock(local_pool_mutex);
+    for (auto const &block : local_pool) {
+      block->set_optimistic_search(enable);
+    }
+  }
+
+  void pool::set_block_affinity(bool enable) { block_affinity.store(enable); }
+
+  void pool::set_lock_policy(lock_policy policy_) {
+    block_lock_policy.store(policy_);
+    auto_lock_policy.store(false);
+    std::lock_guard pool_lock(local_pool_mutex);
+    apply_lock_policy();
+  }
+
+  lock_policy pool::locking() const {
+    if (!auto_lock_policy.load(std::memory_order_relaxed)) {
+      return block_lock_policy.load(std::memory_order_relaxed);
+    }
+    if (lock_stripe_num.load(std::memory_order_relaxed) != 0) {
+      return lock_policy::shared;
+    }
+    //測得多線程時futex的開銷最小
+    return multi_threaded.load(std::memory_order_relaxed) ? lock_policy::futex
+                                                          : lock_policy::none;
+  }
+
+  void pool::apply_lock_policy() const {
+    //撤下快照中的塊並等讀者離開，獨佔鎖擋住其他查詢和釋放的後備路徑
+    publish_blocks(true);
+    auto policy_ = locking();
+    for (auto const &block : local_pool) {
+      block->set_lock_policy(policy_);
+    }
+    publish_blocks();
+  }
+
+  void pool::track_thread() const {
+    if (!auto_lock_policy.load(std::memory_order_relaxed) ||
+        multi_threaded.load(std::memory_order_relaxed)) {
+      return;
+    }
+    auto self = std::this_thread::get_id();
+    auto owner = owner_thread.load(std::memory_order_relaxed);
+    if (owner == self) {
+      return;
+    }
+    if (owner == std::thread::id{} &&
+        owner_thread.compare_exchange_strong(owner, self)) {
+      return;
+    }
+    std::lock_guard pool_lock(local_pool_mutex);
+    if (multi_threaded.load(std::memory_order_relaxed)) {
+      return;
+    }
+    multi_threaded.store(true);
+    apply_lock_policy();
+  }
+
+  void pool::set_adaptive_split(bool enabled, size_t node_num) {
+    presplit_node_num.store(node_num);
+    adaptive_split.store(enabled);
+  }
+
+  void pool::count_order(size_t node_size) {
+    if (!adaptive_split.load(std::memory_order_relaxed)) {
+      return;
+    }
+    order_count[std::bit_width(node_size) - 1].fetch_add(
+        1, std::memory_order_relaxed);
+  }
+
+  void pool::presplit_block(allocator &block) const {
+    if (!adaptive_split.load(std::memory_order_relaxed)) {
+      return;
+    }
+    std::array<size_t, buddy_block_level + 1> counts{};
+    size_t total = 0;
+    for (size_t order = 0; order < counts.size(); order++) {
+      counts[order] = order_count[order].load(std::memory_order_relaxed);
+      total += counts[order];
+    }
+    if (total == 0) {
+      return;
+    }
+    auto node_num = presplit_node_num.load(std::memory_order_relaxed);
+    //先切小的，切分時留下的兄弟節點也能滿足較大的節點
+    for (size_t order = 0; order < counts.size(); order++) {
+      if (counts[order] == 0) {
+        continue;
+      }
+      block.presplit(static_cast<uint8_t>(order),
+                     (std::max)(size_t(1), counts[order] * node_num / total));
+    }
+  }
+
+  void *pool::alloc_impl(size_t size, size_t alignment, bool warn) {
+    if (!check_alloc_size(size)) {
       return nullptr;
     }
+    track_thread();
+    void *ptr = nullptr;
+    size_t alloced_size = 0;
+    if (alloc_in_blocks(
+            [&](allocator &a) {
+              ptr = a.alloc(size, alignment, alloced_size);
+              return ptr != nullptr;
+            },
+            warn)) {
+      count_alloc(alloced_size);
+      count_order(allocator::node_size(size, alignment));
+    }
+    return ptr;
+  }
+
+  pool::handle pool::alloc_handle(size_t size) {
+    if (engine != block_engine::buddy) {
+      spdlog::warn("handle allocation needs buddy engine");
+      failure_count++;
+      return handle::null;
+    }
+    if (!check_alloc_size(size)) {
+      return handle::null;
+    }
+    track_thread();
+    auto res = handle::null;
+    if (alloc_in_blocks(
+            [&](allocator &a) {
+              auto index = a.alloc_node(size);
+              if (index == allocator::npos) {
+                return false;
+              }
+              res = static_cast<handle>(
+                  (static_cast<uint64_t>(a.id()) << 32) | index);
+              return true;
+            },
+            true)) {
+      auto node_size = allocator::node_size(size, 1);
+      count_alloc(node_size);
+      count_order(node_size);
+    } else {
+      failure_count++;
+    }
+    return res;
+  }
+
+  allocator *pool::find_block(const block_list &list, handle h) {
+    auto id = static_cast<uint64_t>(h) >> 32;
+    if (id >= list.table.size()) {
+      return nullptr;
+    }
+    return list.table[id];
+  }
+
+  bool pool::free_in_blocks(const block_list &list, void *ptr,
+                            size_t &freed_size) {
+    for (auto allocator : list.blocks) {
+      if (allocator->free(ptr, freed_size)) {
+        return true;
+      }
+    }
+    return false;
+  }
 
-    //先在已有的空間中分配
-    size_t prev_pool_size = 0;
+  void pool::publish_blocks(bool hide) const {
+    auto list = std::make_unique<block_list>();
+    auto old = block_snapshot.load(std::memory_order_relaxed);
+    list->generation = old ? old->generation + 1 : 0;
+    if (!hide) {
+      for (auto const &block : local_pool) {
+        auto id = block->id();
+        if (id >= list->table.size()) {
+          list->table.resize(id + 1);
+        }
+        list->table[id] = block.get();
+        list->blocks.push_back(block.get());
+      }
+    }
+    block_snapshot.store(list.release());
+    epoch::synchronize();
+    delete old;
+  }
+
+  void *pool::get_pointer(handle h) const {
     {
+      epoch::guard reader;
+      if (auto block = find_block(*block_snapshot.load(), h)) {
+        return block->node_address(static_cast<uint64_t>(h) & UINT32_MAX);
+      }
+    }
+    //塊可能暫時不在快照中
+    std::shared_lock pool_lock(local_pool_mutex);
+    auto block = find_block(*block_snapshot.load(), h);
+    if (!block) {
+      return nullptr;
+    }
+    return block->node_address(static_cast<uint64_t>(h) & UINT32_MAX);
+  }
+
+  bool pool::free(handle h) {
+    if (h == handle::null) {
+      return true;
+    }
+    track_thread();
+    size_t freed_size = 0;
+    auto index = static_cast<uint64_t>(h) & UINT32_MAX;
+    bool res = false;
+    {
+      epoch::guard reader;
+      if (auto block = find_block(*block_snapshot.load(), h)) {
+        res = block->free_node(index, freed_size);
+      }
+    }
+    if (!res) {
+      //塊可能暫時不在快照中
       std::shared_lock pool_lock(local_pool_mutex);
-      prev_pool_size = local_pool.size();
-      for (const auto &allocator : local_pool) {
-        auto ptr = allocator->alloc(size, alignment);
-        if (ptr) {
-          return ptr;
-        }
+      auto block = find_block(*block_snapshot.load(), h);
+      if (!block || !block->free_node(index, freed_size)) {
+        return false;
       }
     }
+    count_free(freed_size);
+    wake_waiters(get_global_pool(gpu_no));
+    return true;
+  }
+
+  void pool::add_local_block(std::unique_ptr<allocator> block) {
+    local_pool.emplace_back(std::move(block));
+  }
+
+  void *pool::alloc_wait(size_t size,
+                         std::chrono::steady_clock::duration timeout) {
+    return alloc_wait(size, 1, timeout);
+  }
+
+  void *pool::alloc_wait(size_t size, size_t alignment,
+                         std::chrono::steady_clock::duration timeout) {
+    auto ptr = alloc_impl(size, alignment, false);
+    if (ptr) {
+      return ptr;
+    }
+    if (size > (1ULL << buddy_block_level)) {
+      failure_count++;
+      return ptr;
+    }
 
-    auto block = get_block();
-    if (!block.get()) {
-      {
-        std::shared_lock pool_lock(local_pool_mutex);
-        if (prev_pool_size >= local_pool.size()) {
-          return nullptr;
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    auto &global_pool = get_global_pool(gpu_no);
+    // 先登記再嘗試，這樣free要麼看到等待者，要麼它釋放的空間被這裏看到
+    global_pool.waiter_num++;
+    {
+      std::unique_lock lk(global_pool.wait_mutex);
+      while (!(ptr = alloc_impl(size, alignment, false))) {
+        if (global_pool.wait_cv.wait_until(lk, deadline) ==
+            std::cv_status::timeout) {
+          ptr = alloc_impl(size, alignment, false);
+          break;
         }
       }
-      return alloc(size, alignment);
     }
+    global_pool.waiter_num--;
+    if (!ptr) {
+      failure_count++;
+      spdlog::warn("wait for allocation of size {} timeout", size);
+    }
+    return ptr;
+  }
+
+  pool::alloc_awaiter pool::alloc_async(size_t size) {
+    return alloc_async(size, 1);
+  }
+
+  pool::alloc_awaiter pool::alloc_async(size_t size, size_t alignment) {
+    return alloc_awaiter(*this, size, alignment);
+  }
+
+  pool::alloc_awaiter::alloc_awaiter(pool &owner_, size_t size_,
+                                     size_t alignment_)
+      : owner(&owner_), size(size_), alignment(alignment_) {}
 
+  bool pool::alloc_awaiter::await_ready() {
+    ptr = owner->alloc_impl(size, alignment, false);
+    return ptr || size > (1ULL << buddy_block_level);
+  }
+
+  bool pool::alloc_awaiter::await_suspend(std::coroutine_handle<> handle_) {
+    auto &global_pool = get_global_pool(owner->gpu_no);
+    coroutine = handle_;
+    global_pool.waiter_num++;
+    std::lock_guard lk(global_pool.wait_mutex);
+    //已經有人在排隊時不插隊
+    if (global_pool.awaiters.empty()) {
+      ptr = owner->alloc_impl(size, alignment, false);
+      if (ptr) {
+        global_pool.waiter_num--;
+        return false;
+      }
+    }
+    global_pool.awaiters.push_back(this);
+    return true;
+  }
+
+  void pool::wake_waiters(global_pool_type &global_pool) {
+    if (global_pool.waiter_num.load() == 0) {
+      return;
+    }
+    std::vector<alloc_awaiter *> ready_awaiters;
     {
-      std::lock_guard pool_lock(local_pool_mutex);
-      local_pool.emplace_back(std::move(block));
+      std::lock_guard lk(global_pool.wait_mutex);
+      while (!global_pool.awaiters.empty()) {
+        auto awaiter = global_pool.awaiters.front();
+        awaiter->ptr = awaiter->owner->alloc_impl(awaiter->size,
+                                                  awaiter->alignment, false);
+        if (!awaiter->ptr) {
+          break;
+        }
+        global_pool.awaiters.pop_front();
+        global_pool.waiter_num--;
+        ready_awaiters.push_back(awaiter);
+      }
+    }
+    global_pool.wait_cv.notify_all();
+    for (auto awaiter : ready_awaiters) {
+      awaiter->coroutine.resume();
     }
-    return alloc(size, alignment);
   }
   uint8_t pool::get_max_level() const {
     if (data_location == alloc_location::host) {
@@ -91,6 +676,14 @@ namespace cuda_buddy {
     return device_max_level.load();
   }
 
+  size_t pool::get_max_block_num() const {
+    auto max_level = get_max_level();
+    if (max_level < buddy_block_level) {
+      return 0;
+    }
+    return static_cast<size_t>(1ULL << (max_level - buddy_block_level));
+  }
+
   pool::global_pool_type &pool::get_global_pool(int gpu_no) {
     if (gpu_no < 0) {
       return global_host_pool;
@@ -104,38 +697,290 @@ namespace cuda_buddy {
   }
 
   bool pool::free(void *ptr) {
-    std::shared_lock pool_lock(local_pool_mutex);
-    for (auto &allocator : local_pool) {
-      if (allocator->free(ptr)) {
-        return true;
-      }
+    auto traced = CUDA_BUDDY_PROBE_ENABLED(pool_free);
+    auto recorded = tracer::enabled();
+    auto timed = latency_histogram::enabled();
+    probe::timer timer(traced || recorded || timed);
+    bool res = false;
+    size_t freed_size = 0;
+    track_thread();
+    {
+      epoch::guard reader;
+      res = free_in_blocks(*block_snapshot.load(), ptr, freed_size);
     }
-    return false;
+    if (!res) {
+      //塊可能暫時不在快照中
+      std::shared_lock pool_lock(local_pool_mutex);
+      res = free_in_blocks(*block_snapshot.load(), ptr, freed_size);
+    }
+    if (res) {
+      count_free(freed_size);
+      wake_waiters(get_global_pool(gpu_no));
+    }
+    if (timed) {
+      latency_histogram::record(latency_histogram::operation::pool_free,
+                                timer.elapsed_ns());
+    }
+    if (traced) {
+      CUDA_BUDDY_PROBE(pool_free, ptr, res, timer.elapsed_ns());
+    }
+    if (recorded) {
+      trace(tracer::event_type::free, timer, reinterpret_cast<uintptr_t>(ptr),
+            0);
+      trace_usage();
+    }
+    return res;
+  }
+  size_t pool::live_count() const {
+    auto usage = total_usage();
+    return usage.alloc_count - usage.free_count;
+  }
+
+  void pool::init_preferred_blocks() {
+    //不同分片的線程從不同的塊開始
+    for (size_t i = 0; i < usage_shard_num; i++) {
+      usage_shards[i].preferred_block.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  pool::usage_shard &pool::local_usage() {
+    thread_local size_t shard =
+        std::hash<std::thread::id>{}(std::this_thread::get_id()) %
+        usage_shard_num;
+    return usage_shards[shard];
+  }
+
+  void pool::count_alloc(size_t size) {
+    auto &usage = local_usage();
+    usage.used_size.fetch_add(size, std::memory_order_relaxed);
+    usage.alloc_count.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void pool::count_free(size_t size) {
+    auto &usage = local_usage();
+    usage.used_size.fetch_sub(size, std::memory_order_relaxed);
+    usage.free_count.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  pool::usage_totals pool::total_usage() const {
+    usage_totals res{};
+    for (auto const &usage : usage_shards) {
+      res.used_size += usage.used_size.load(std::memory_order_relaxed);
+      res.alloc_count += usage.alloc_count.load(std::memory_order_relaxed);
+      res.free_count += usage.free_count.load(std::memory_order_relaxed);
+    }
+    return res;
+  }
+
+  size_t pool::total_used_size() const {
+    size_t res = 0;
+    for (auto const &usage : usage_shards) {
+      res += usage.used_size.load(std::memory_order_relaxed);
+    }
+    return res;
   }
+
   bool pool::full() const {
+    if (!region) {
+      return total_used_size() == 0;
+    }
+    //共享區域中的塊也被其他進程使用，只能逐個檢查
     std::shared_lock pool_lock(local_pool_mutex);
     return std::all_of(local_pool.begin(), local_pool.end(),
                        [](auto const &a) { return a->full(); });
   }
 
+  size_t pool::get_global_block_num() const {
+    if (region) {
+      return 0;
+    }
+    return get_global_pool(gpu_no).available_block_num(get_max_block_num());
+  }
+
+  size_t pool::largest_free() const {
+    if (get_global_block_num() != 0) {
+      return 1ULL << buddy_block_level;
+    }
+    size_t res = 0;
+    track_thread();
+    std::shared_lock pool_lock(local_pool_mutex);
+    for (const auto &allocator : local_pool) {
+      res = (std::max)(res, allocator->largest_free());
+    }
+    return res;
+  }
+
+  bool pool::can_alloc(size_t size, size_t alignment) const {
+    if (size > (1ULL << buddy_block_level)) {
+      return false;
+    }
+    auto needed_size = (engine == block_engine::tlsf)
+                           ? tlsf::block_size(size, alignment)
+                           : allocator::node_size(size, alignment);
+    return needed_size <= largest_free();
+  }
+
+  size_t pool::free_bytes() const {
+    size_t res = get_global_block_num() * (1ULL << buddy_block_level);
+    track_thread();
+    std::shared_lock pool_lock(local_pool_mutex);
+    for (const auto &allocator : local_pool) {
+      res += allocator->free_bytes();
+    }
+    return res;
+  }
+
+  std::optional<reservation> pool::reserve(size_t size) {
+    constexpr size_t block_size = 1ULL << buddy_block_level;
+    auto block_num = (size + block_size - 1) / block_size;
+    std::vector<std::unique_ptr<allocator>> blocks;
+    blocks.reserve(block_num);
+    while (blocks.size() < block_num) {
+      auto block = get_block(true);
+      if (!block) {
+        auto &global_pool = get_global_pool(gpu_no);
+        for (auto &b : blocks) {
+          global_pool.add_block(std::move(b));
+        }
+        wake_waiters(global_pool);
+        return {};
+      }
+      blocks.emplace_back(std::move(block));
+    }
+    for (auto &block : blocks) {
+      setup_block(*block);
+    }
+    return reservation(*this, std::move(blocks), size);
+  }
+
+  void pool::add_blocks(std::vector<std::unique_ptr<allocator>> blocks) {
+    {
+      std::lock_guard pool_lock(local_pool_mutex);
+      for (auto &block : blocks) {
+        setup_block(*block);
+        add_local_block(std::move(block));
+      }
+      publish_blocks();
+    }
+    wake_waiters(get_global_pool(gpu_no));
+  }
+
+  reservation::reservation(pool &owner_,
+                           std::vector<std::unique_ptr<allocator>> blocks_,
+                           size_t size)
+      : owner(&owner_), blocks(std::move(blocks_)), remaining_size(size) {}
+
+  reservation::reservation(reservation &&rhs) noexcept
+      : owner(rhs.owner), blocks(std::move(rhs.blocks)),
+        remaining_size(rhs.remaining_size) {
+    rhs.owner = nullptr;
+    rhs.remaining_size = 0;
+  }
+
+  reservation &reservation::operator=(reservation &&rhs) {
+    if (this == &rhs) {
+      return *this;
+    }
+    //先把自己的塊歸還給pool，否則它們隨unique_ptr銷毀，全局池的塊數不再減少
+    if (owner && !blocks.empty()) {
+      owner->add_blocks(std::move(blocks));
+    }
+    owner = rhs.owner;
+    blocks = std::move(rhs.blocks);
+    remaining_size = rhs.remaining_size;
+    rhs.owner = nullptr;
+    rhs.blocks.clear();
+    rhs.remaining_size = 0;
+    return *this;
+  }
+
+  reservation::~reservation() {
+    if (owner && !blocks.empty()) {
+      owner->add_blocks(std::move(blocks));
+    }
+  }
+
+  void *reservation::alloc(size_t size) { return alloc(size, 1); }
+
+  void *reservation::alloc(size_t size, size_t alignment) {
+    auto node_size = allocator::node_size(size, alignment);
+    if (node_size > remaining_size) {
+      spdlog::warn("reservation exhausted, size {} remaining {}", node_size,
+                   remaining_size);
+      return nullptr;
+    }
+    for (const auto &allocator : blocks) {
+      auto ptr = allocator->alloc(size, alignment);
+      if (ptr) {
+        remaining_size -= node_size;
+        owner->count_alloc(node_size);
+        return ptr;
+      }
+    }
+    return nullptr;
+  }
+
+  bool reservation::free(void *ptr) {
+    size_t freed_size = 0;
+    for (auto &allocator : blocks) {
+      if (allocator->free(ptr, freed_size)) {
+        owner->count_free(freed_size);
+        return true;
+      }
+    }
+    return false;
+  }
+
   bool pool::release() {
+    auto traced = CUDA_BUDDY_PROBE_ENABLED(pool_release);
+    auto recorded = tracer::enabled();
+    probe::timer timer(traced || recorded);
     std::lock_guard pool_lock(local_pool_mutex);
     if (local_pool.empty()) {
       return true;
     }
-    local_pool[0]->sync_stream();
+    size_t released_block_num = 0;
+    {
+      probe::timer sync_timer(recorded);
+      local_pool[0]->sync_stream();
+      if (recorded) {
+        trace(tracer::event_type::sync_stream, sync_timer, 0, 0);
+      }
+    }
     auto &global_pool = get_global_pool(gpu_no);
+    //沒有未釋放的分配時所有塊都是空的，不需要逐個加鎖檢查
+    auto all_free = total_used_size() == 0;
     size_t i = 0;
     while (i < local_pool.size()) {
-      if (!local_pool[i]->full()) {
+      if (!all_free && !local_pool[i]->full()) {
         i++;
         continue;
       }
+      //全局池中的塊都用buddy，由取得它的pool決定算法
+      local_pool[i]->set_engine(block_engine::buddy);
+      local_pool[i]->set_fit_policy(fit_policy::first_fit);
+      local_pool[i]->set_lazy_coalescing(0);
+      local_pool[i]->set_wide_index(false);
+      local_pool[i]->set_lock_stripes(0);
+      local_pool[i]->clear_presplit();
+      local_pool[i]->set_optimistic_search(false);
+      local_pool[i]->set_lock_policy(lock_policy::shared);
       if (i + 1 < local_pool.size()) {
         std::swap(local_pool[i], local_pool.back());
       }
       global_pool.add_block(std::move(local_pool.back()));
       local_pool.pop_back();
+      released_block_num++;
+    }
+    if (released_block_num != 0) {
+      publish_blocks();
+    }
+    if (traced) {
+      CUDA_BUDDY_PROBE(pool_release, gpu_no, released_block_num,
+                       local_pool.size(), timer.elapsed_ns());
+    }
+    if (recorded) {
+      trace(tracer::event_type::release, timer, released_block_num, 0);
     }
     return local_pool.empty();
   }
@@ -145,13 +990,28 @@ namespace cuda_buddy {
     global_pool.clear();
   }
 
-  std::unique_ptr<allocator> pool::get_block() {
+  std::unique_ptr<allocator> pool::get_block(bool warn) {
+    if (region) {
+      if (warn) {
+        spdlog::warn("no block available in shared memory region");
+      }
+      return {};
+    }
+    auto traced = CUDA_BUDDY_PROBE_ENABLED(pool_get_block);
+    auto recorded = tracer::enabled();
+    auto timed = latency_histogram::enabled();
+    probe::timer timer(traced || recorded || timed);
     auto &global_pool = get_global_pool(gpu_no);
     std::lock_guard global_pool_lock(global_pool.pool_mutex);
+    if (recorded) {
+      trace(tracer::event_type::lock_wait, timer, 0, 0);
+    }
     if (global_pool.pool.empty()) {
-      auto max_block_num =
-          static_cast<size_t>(1ULL << (get_max_level() - buddy_block_level));
+      auto max_block_num = get_max_block_num();
       if (global_pool.alloced_block_num >= max_block_num) {
+        if (!warn) {
+          return {};
+        }
         auto location_str =
             (data_location == alloc_location::host) ? "host" : "device";
         spdlog::warn(
@@ -161,13 +1021,35 @@ namespace cuda_buddy {
             location_str);
         return {};
       }
-      auto buddy_block =
-          std::make_unique<allocator>(buddy_block_level, data_location);
+      auto buddy_block = std::make_unique<allocator>(
+          buddy_block_level, data_location, global_pool.take_block_id());
       global_pool.alloced_block_num++;
+      if (timed) {
+        latency_histogram::record(latency_histogram::operation::get_block,
+                                  timer.elapsed_ns());
+      }
+      if (traced) {
+        CUDA_BUDDY_PROBE(pool_get_block, gpu_no, buddy_block->id(), true,
+                         timer.elapsed_ns());
+      }
+      if (recorded) {
+        trace(tracer::event_type::get_block, timer, buddy_block->id(), 1);
+      }
       return buddy_block;
     }
     auto buddy_block = std::move(global_pool.pool.front());
     global_pool.pool.pop_front();
+    if (timed) {
+      latency_histogram::record(latency_histogram::operation::get_block,
+                                timer.elapsed_ns());
+    }
+    if (traced) {
+      CUDA_BUDDY_PROBE(pool_get_block, gpu_no, buddy_block->id(), false,
+                       timer.elapsed_ns());
+    }
+    if (recorded) {
+      trace(tracer::event_type::get_block, timer, buddy_block->id(), 0);
+    }
     return buddy_block;
   }
 } // namespace cuda_buddy
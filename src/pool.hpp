@@ -9,16 +9,67 @@
 
 #include <array>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
 #include <cstddef>
 #include <list>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <shared_mutex>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include "allocator.hpp"
+#include "lock_stats.hpp"
+#include "tracer.hpp"
 
 namespace cuda_buddy {
+  class pool;
+  class host_region;
+  namespace probe {
+    class timer;
+  }
+
+  //! 從pool預留的塊，預留時不切分節點。
+  /*!
+   * 每次分配按實際佔用的節點大小(allocator::node_size)扣減預留量，
+   * 只要扣減後不為負就一定成功。預留不是線程安全的，析構或被移動賦值
+   * 覆蓋時剩下的塊歸還給pool，尚未釋放的指針之後可以通過pool::free釋放。
+   *
+   * 兩個限制：預留按整塊(2^pool::buddy_block_level字節)從全局池取得，
+   * 很小的預留也佔用一整塊；釋放的內存不會加回預留量，否則碎片會破壞
+   * 上面的保證，所以預留量要覆蓋整個生命期內所有分配的總和，反復分配
+   * 釋放的循環應該在每輪重新預留。
+   */
+  class reservation final {
+  public:
+    reservation(const reservation &) = delete;
+    reservation &operator=(const reservation &) = delete;
+
+    reservation(reservation &&rhs) noexcept;
+    reservation &operator=(reservation &&rhs);
+
+    ~reservation();
+
+    void *alloc(size_t size);
+    void *alloc(size_t size, size_t alignment);
+    bool free(void *ptr);
+    size_t remaining() const { return remaining_size; }
+
+  private:
+    friend class pool;
+    reservation(pool &owner_, std::vector<std::unique_ptr<allocator>> blocks_,
+                size_t size);
+
+  private:
+    pool *owner{nullptr};
+    std::vector<std::unique_ptr<allocator>> blocks;
+    size_t remaining_size{};
+  };
+
   class pool final {
 
   public:
@@ -26,7 +77,10 @@ namespace cuda_buddy {
     static void set_host_pool_size(uint8_t max_level);
 
   public:
-    explicit pool(int gpu_no_);
+    //! engine_是從全局池取得的塊使用的分配算法，見block_engine
+    explicit pool(int gpu_no_, block_engine engine_ = block_engine::buddy);
+    //! 使用共享內存區域中的塊，塊數固定，不使用全局池。region必須比pool存活更久
+    explicit pool(host_region &region_);
 
     pool(const pool &) = delete;
     pool &operator=(const pool &) = delete;
@@ -41,6 +95,140 @@ namespace cuda_buddy {
     bool free(void *ptr);
     bool full() const;
 
+    //! 把塊編號和節點下標打包成句柄，釋放時直接定位到節點，只支持buddy
+    enum class handle : uint64_t { null = UINT64_MAX };
+    handle alloc_handle(size_t size);
+    void *get_pointer(handle h) const;
+    bool free(handle h);
+
+    //! 下面的查詢把全局池中可取得的塊也算在內，不會加鎖分配
+    size_t largest_free() const;
+    bool can_alloc(size_t size, size_t alignment) const;
+    size_t free_bytes() const;
+    //! 已分配節點的總字節數，除共享內存區域的pool外是常數時間
+    size_t used_bytes() const;
+    //! 還沒有釋放的分配數
+    size_t live_count() const;
+
+    struct statistics {
+      //! host塊為-1
+      int gpu_no;
+      size_t used_bytes;
+      //! 這個pool持有的塊
+      size_t block_num;
+      //! 全局池中同一設備的空閒塊
+      size_t cached_block_num;
+      size_t alloc_count;
+      size_t free_count;
+      size_t failure_count;
+      size_t live_count;
+    };
+    statistics get_statistics() const;
+
+    //! 每個鎖的等待和持有時間，需要先lock_stats::enable
+    struct lock_statistics {
+      lock_stats::snapshot local_pool;
+      //! 同一設備的全局池，共享內存區域的pool沒有
+      lock_stats::snapshot global_pool;
+      //! 這個pool持有的塊
+      std::vector<uint32_t> block_ids;
+      std::vector<lock_stats::snapshot> blocks;
+    };
+    lock_statistics get_lock_statistics() const;
+
+    //! 每個塊一行的佔用矩陣，見allocator::occupancy
+    struct occupancy_map {
+      size_t resolution;
+      //! 前local_block_num行是這個pool持有的塊，其餘是全局池中緩存的塊
+      size_t local_block_num;
+      std::vector<uint32_t> block_ids;
+      //! 行優先，block_ids.size()*resolution個格子
+      std::vector<uint8_t> cells;
+    };
+    occupancy_map occupancy(size_t resolution = 256) const;
+    //! 以PGM灰度圖寫出occupancy的矩陣，越亮佔用越多
+    bool write_occupancy(const std::string &path,
+                         size_t resolution = 256) const;
+
+    //! 內存不足時阻塞，直到free或其他pool歸還塊，超時返回nullptr
+    void *alloc_wait(size_t size, std::chrono::steady_clock::duration timeout);
+    void *alloc_wait(size_t size, size_t alignment,
+                     std::chrono::steady_clock::duration timeout);
+
+    //! 用於co_await的分配
+    /*!
+     * 內存不足時掛起協程，同一設備上的free按FIFO順序恢復等待者，
+     * 協程在執行free的線程上恢復。等待期間pool必須存活。
+     */
+    class alloc_awaiter final {
+    public:
+      bool await_ready();
+      bool await_suspend(std::coroutine_handle<> handle_);
+      void *await_resume() const noexcept { return ptr; }
+
+    private:
+      friend class pool;
+      alloc_awaiter(pool &owner_, size_t size_, size_t alignment_);
+
+    private:
+      pool *owner;
+      size_t size;
+      size_t alignment;
+      void *ptr{nullptr};
+      std::coroutine_handle<> coroutine;
+    };
+    alloc_awaiter alloc_async(size_t size);
+    alloc_awaiter alloc_async(size_t size, size_t alignment);
+
+    //! 按觀察到的分配大小分佈預先切分新取得的塊
+    /*!
+     * 啓用後統計每種節點大小的分配次數，之後新取得的塊(包括reserve和
+     * 歸還預留的塊)按次數比例切分出共約node_num個空閒節點(每種大小至少
+     * 一個)，釋放時保留這些節點不合併，見allocator::presplit。
+     * 塊歸還全局池時取消保留。
+     */
+    void set_adaptive_split(bool enabled, size_t node_num = 64);
+
+    //! 這個pool持有的塊和之後取得的塊使用的buddy節點選擇策略
+    void set_fit_policy(fit_policy policy_);
+
+    //! 這個pool持有的塊和之後取得的塊的延遲合併，見allocator::set_lazy_coalescing
+    void set_lazy_coalescing(size_t max_deferred_num_);
+
+    //! 這個pool持有的塊和之後取得的塊的8叉索引，見allocator::set_wide_index
+    void set_wide_index(bool enable);
+
+    //! 這個pool持有的塊和之後取得的塊的條帶鎖，見allocator::set_lock_stripes
+    void set_lock_stripes(size_t stripe_num);
+
+    //! 這個pool持有的塊和之後取得的塊的樂觀查找，見allocator::set_optimistic_search
+    void set_optimistic_search(bool enable);
+
+    //! 每個線程從它在這個pool中上次分配成功的塊開始找
+    /*!
+     * 多個線程共享pool時不再都從第一個塊開始，分散在不同塊的鎖上，
+     * 每個線程反復訪問的也是同一個塊的元數據。起點記錄在線程所在的
+     * 用量分片中，初始的塊按分片分散，同一分片的線程共用起點。代價是
+     * 分配不再集中在前面的塊，後面的塊更難整塊空閒歸還。默認關閉。
+     */
+    void set_block_affinity(bool enable);
+
+    //! 固定這個pool持有的塊和之後取得的塊的鎖，見allocator::set_lock_policy
+    /*!
+     * 默認由pool選擇：只有一個線程調用過pool時用none，另一個線程調用
+     * 分配、釋放、查詢或設置時換成futex，開啓條帶鎖時用shared。調用這個
+     * 函數後不再自動切換，這時none要求只有一個線程使用pool，
+     * largest_free、free_bytes、can_alloc和occupancy這些查詢也不例外。
+     * 切換時暫時從快照中撤下持有的塊，等正在進行的分配和釋放結束。
+     * 共享內存區域的pool固定使用進程間鎖。
+     */
+    void set_lock_policy(lock_policy policy_);
+    //! 持有的塊現在使用的鎖
+    lock_policy locking() const;
+
+    //! 從全局池取得足夠的塊預留size字節，塊不夠時返回空
+    std::optional<reservation> reserve(size_t size);
+
     static void release_global_pool(int gpu_no);
 
   public:
@@ -49,9 +237,18 @@ namespace cuda_buddy {
 
   private:
     struct global_pool_type final {
-      std::mutex pool_mutex;
+      instrumented_mutex<std::mutex> pool_mutex;
       std::list<std::unique_ptr<allocator>> pool;
       size_t alloced_block_num;
+      uint32_t next_block_id;
+      //! 已銷毀塊的id，重用它們使pool的塊表大小受限於同時存在的塊數
+      std::vector<uint32_t> free_block_ids;
+
+      //等待內存的alloc_wait調用和協程
+      std::atomic<size_t> waiter_num;
+      std::mutex wait_mutex;
+      std::condition_variable wait_cv;
+      std::list<alloc_awaiter *> awaiters;
 
       void add_block(std::unique_ptr<allocator> block) {
         std::lock_guard lk(pool_mutex);
@@ -59,21 +256,137 @@ namespace cuda_buddy {
       }
       void clear() {
         std::lock_guard lk(pool_mutex);
+        alloced_block_num -= pool.size();
+        for (auto const &block : pool) {
+          free_block_ids.push_back(block->id());
+        }
         pool.clear();
       }
+      //! 調用者需持有pool_mutex
+      uint32_t take_block_id() {
+        if (free_block_ids.empty()) {
+          return next_block_id++;
+        }
+        auto id = free_block_ids.back();
+        free_block_ids.pop_back();
+        return id;
+      }
+      size_t cached_block_num() {
+        std::lock_guard lk(pool_mutex);
+        return pool.size();
+      }
+      void append_occupancy(occupancy_map &map) {
+        std::lock_guard lk(pool_mutex);
+        for (auto const &block : pool) {
+          map.block_ids.push_back(block->id());
+          auto row = block->occupancy(map.resolution);
+          map.cells.insert(map.cells.end(), row.begin(), row.end());
+        }
+      }
+      //! 緩存的塊加上還能新分配的塊
+      size_t available_block_num(size_t max_block_num) {
+        std::lock_guard lk(pool_mutex);
+        auto num = pool.size();
+        if (alloced_block_num < max_block_num) {
+          num += max_block_num - alloced_block_num;
+        }
+        return num;
+      }
     };
 
   private:
+    friend class reservation;
     bool release();
+    bool check_alloc_size(size_t size) const;
+    template <typename F> bool alloc_in_blocks(F &&try_alloc, bool warn);
+    void *alloc_impl(size_t size, size_t alignment, bool warn);
+    void add_local_block(std::unique_ptr<allocator> block);
+    void count_order(size_t node_size);
+    void presplit_block(allocator &block) const;
+    //! 按pool的設置配置新加入的塊
+    void setup_block(allocator &block) const;
+    //! 分配和釋放遍歷的不可變塊列表，持有的塊變化時整體替換
+    struct block_list final {
+      uint64_t generation;
+      std::vector<allocator *> blocks;
+      //! 按塊編號索引
+      std::vector<allocator *> table;
+    };
+    //! 從local_pool生成新的快照並替換，等舊快照的讀者離開後刪除它
+    /*!
+     * 持有local_pool_mutex的獨佔鎖調用。讀者在epoch::guard中訪問快照，
+     * 不加鎖，也不寫共享的cache line。
+     */
+    void publish_blocks(bool hide = false) const;
+    //! 自動選擇鎖時記錄調用pool的線程，出現第二個線程後換成futex
+    void track_thread() const;
+    //! 持有local_pool_mutex的獨佔鎖調用，撤下快照後把持有的塊換成locking()
+    void apply_lock_policy() const;
+    static allocator *find_block(const block_list &list, handle h);
+    //! 按線程分片的用量計數，分配和釋放只寫所在線程分片的cache line
+    /*!
+     * 一個線程分配、另一個線程釋放時單個分片會回繞，無符號的總和仍然正確。
+     * 讀取時累加固定個數的分片，有並發的修改時是近似值。
+     */
+    struct alignas(64) usage_shard final {
+      std::atomic<size_t> used_size{0};
+      std::atomic<size_t> alloc_count{0};
+      std::atomic<size_t> free_count{0};
+      //! 開啟塊親和時這個分片的線程上次分配成功的塊在快照中的位置，
+      //! 每個pool各自記錄，同一分片的線程共用
+      std::atomic<size_t> preferred_block{0};
+    };
+    struct usage_totals final {
+      size_t used_size;
+      size_t alloc_count;
+      size_t free_count;
+    };
+    static constexpr size_t usage_shard_num{16};
+    usage_shard &local_usage();
+    void init_preferred_blocks();
+    void count_alloc(size_t size);
+    void count_free(size_t size);
+    usage_totals total_usage() const;
+    size_t total_used_size() const;
+    static bool free_in_blocks(const block_list &list, void *ptr,
+                               size_t &freed_size);
+    void trace(tracer::event_type type, const probe::timer &timer,
+               uint64_t arg0, uint64_t arg1) const;
+    void trace_usage() const;
+    static void wake_waiters(global_pool_type &global_pool);
+    void add_blocks(std::vector<std::unique_ptr<allocator>> blocks);
     uint8_t get_max_level() const;
-    std::unique_ptr<allocator> get_block();
+    size_t get_max_block_num() const;
+    size_t get_global_block_num() const;
+    std::unique_ptr<allocator> get_block(bool warn);
     static global_pool_type &get_global_pool(int gpu_no);
 
   private:
     int gpu_no{-1};
     alloc_location data_location{alloc_location::host};
+    block_engine engine{block_engine::buddy};
+    host_region *region{nullptr};
+    //! 持有的塊，由local_pool_mutex保護，查詢和設置加共享鎖遍歷
     std::vector<std::unique_ptr<allocator>> local_pool;
-    mutable std::shared_timed_mutex local_pool_mutex;
+    mutable instrumented_mutex<std::shared_timed_mutex> local_pool_mutex;
+    mutable std::atomic<const block_list *> block_snapshot{nullptr};
+    std::array<usage_shard, usage_shard_num> usage_shards{};
+    std::atomic<size_t> failure_count{0};
+    std::atomic<fit_policy> policy{fit_policy::first_fit};
+    std::atomic<size_t> max_deferred_num{0};
+    std::atomic<bool> wide_index{false};
+    std::atomic<size_t> lock_stripe_num{0};
+    std::atomic<bool> optimistic_search{false};
+    std::atomic<lock_policy> block_lock_policy{lock_policy::shared};
+    std::atomic<bool> auto_lock_policy{true};
+    //! 自動選擇鎖時第一個調用pool的線程
+    mutable std::atomic<std::thread::id> owner_thread{};
+    mutable std::atomic<bool> multi_threaded{false};
+    std::atomic<bool> block_affinity{false};
+    std::atomic<bool> adaptive_split{false};
+    std::atomic<size_t> presplit_node_num{64};
+    //! 按節點大小的冪次統計的分配次數
+    std::array<std::atomic<size_t>, buddy_block_level + 1> order_count{};
 
   private:
     static inline std::atomic<uint8_t> device_max_level{0};
@@ -0,0 +1,17 @@
+/*!
+ * \file probe.cpp
+ *
+ * \brief USDT追蹤點的semaphore
+ * \date 2026-10-17
+ */
+
+#include "probe.hpp"
+
+#ifdef CUDA_BUDDY_DEFINE_PROBE
+CUDA_BUDDY_DEFINE_PROBE(pool_alloc)
+CUDA_BUDDY_DEFINE_PROBE(pool_free)
+CUDA_BUDDY_DEFINE_PROBE(pool_get_block)
+CUDA_BUDDY_DEFINE_PROBE(pool_release)
+CUDA_BUDDY_DEFINE_PROBE(allocator_alloc_fail)
+CUDA_BUDDY_DEFINE_PROBE(allocator_combine)
+#endif
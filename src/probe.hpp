@@ -0,0 +1,80 @@
+/*!
+ * \file probe.hpp
+ *
+ * \brief USDT靜態追蹤點
+ * \date 2026-10-17
+ */
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+// 有sys/sdt.h時編譯進USDT追蹤點，未被bpftrace/perf掛接時只有一次semaphore讀取。
+// 追蹤點的參數:
+//   pool_alloc(size, alignment, ptr, latency_ns)
+//   pool_free(ptr, freed, latency_ns)
+//   pool_get_block(gpu_no, block_id, new_block, latency_ns)
+//   pool_release(gpu_no, released_block_num, kept_block_num, latency_ns)
+//   allocator_alloc_fail(block_id, size, order)
+//   allocator_combine(block_id, from_order, to_order)
+#if __has_include(<sys/sdt.h>) && !defined(CUDA_BUDDY_DISABLE_USDT)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define CUDA_BUDDY_PROBE_SEMAPHORE(name) cuda_buddy_##name##_semaphore
+#define CUDA_BUDDY_DECLARE_PROBE(name)                                         \
+  extern "C" unsigned short CUDA_BUDDY_PROBE_SEMAPHORE(name)
+#define CUDA_BUDDY_DEFINE_PROBE(name)                                          \
+  extern "C" {                                                                 \
+  __extension__ unsigned short CUDA_BUDDY_PROBE_SEMAPHORE(name)                \
+      __attribute__((unused)) __attribute__((section(".probes")));             \
+  }
+#define CUDA_BUDDY_PROBE_ENABLED(name)                                         \
+  __builtin_expect(CUDA_BUDDY_PROBE_SEMAPHORE(name) != 0, 0)
+#define CUDA_BUDDY_PROBE(name, ...) STAP_PROBEV(cuda_buddy, name, __VA_ARGS__)
+
+CUDA_BUDDY_DECLARE_PROBE(pool_alloc);
+CUDA_BUDDY_DECLARE_PROBE(pool_free);
+CUDA_BUDDY_DECLARE_PROBE(pool_get_block);
+CUDA_BUDDY_DECLARE_PROBE(pool_release);
+CUDA_BUDDY_DECLARE_PROBE(allocator_alloc_fail);
+CUDA_BUDDY_DECLARE_PROBE(allocator_combine);
+#else
+#define CUDA_BUDDY_PROBE_ENABLED(name) false
+//不求值參數，只讓只給追蹤點用的變量不被當作未使用
+#define CUDA_BUDDY_PROBE(name, ...)                                            \
+  do {                                                                         \
+    if (false) {                                                               \
+      cuda_buddy::probe::consume(__VA_ARGS__);                                 \
+    }                                                                          \
+  } while (0)
+#endif
+
+namespace cuda_buddy::probe {
+  template <typename... Args> void consume(const Args &...) {}
+
+  //! 只在追蹤點被掛接或tracer啓用時計時
+  class timer final {
+  public:
+    explicit timer(bool enabled) {
+      if (enabled) {
+        start = std::chrono::steady_clock::now();
+      }
+    }
+    uint64_t start_ns() const {
+      return static_cast<uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              start.time_since_epoch())
+              .count());
+    }
+    uint64_t elapsed_ns() const {
+      return static_cast<uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start)
+              .count());
+    }
+
+  private:
+    std::chrono::steady_clock::time_point start;
+  };
+} // namespace cuda_buddy::probe
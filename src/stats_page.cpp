@@ -0,0 +1,259 @@
+/*!
+ * \file stats_page.cpp
+ *
+ * \brief 把pool的統計定期寫到具名共享內存，供外部監控程序直接讀取
+ * \date 2026-10-17
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <spdlog/spdlog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+
+#include "pool.hpp"
+#include "stats_page.hpp"
+
+namespace cuda_buddy {
+
+  namespace {
+    constexpr uint64_t stats_magic = 0x7374617473627564ULL;
+    constexpr uint32_t stats_version = 1;
+  } // namespace
+
+  struct stats_page::page_header final {
+    //! 初始化完成後才寫入
+    std::atomic<uint64_t> magic;
+    uint32_t version;
+    uint32_t slot_num;
+    uint64_t publish_interval_ms;
+  };
+
+  //! 寫者把sequence加一成奇數，寫字段，再加一成偶數；
+  //! 讀者看到兩次相同的偶數sequence時讀到的字段是一致的
+  struct alignas(64) stats_page::slot final {
+    std::atomic<uint64_t> sequence;
+    uint64_t in_use;
+    snapshot data;
+  };
+
+  namespace {
+    static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+    void store_field(uint64_t &field, uint64_t value) {
+      std::atomic_ref<uint64_t>(field).store(value,
+                                             std::memory_order_relaxed);
+    }
+
+    //! 讀者的映射是只讀的，64位的原子讀不會寫內存
+    uint64_t load_field(const uint64_t &field) {
+      return std::atomic_ref<uint64_t>(const_cast<uint64_t &>(field))
+          .load(std::memory_order_relaxed);
+    }
+  } // namespace
+
+  size_t stats_page::page_size() { return 64 + slot_num * sizeof(slot); }
+
+  stats_page::stats_page(std::string name_,
+                         std::chrono::milliseconds interval_)
+      : name(std::move(name_)), interval(interval_), pools(slot_num) {
+    static_assert(sizeof(page_header) <= 64);
+    static_assert(sizeof(snapshot) % sizeof(uint64_t) == 0);
+
+    auto fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "shm_open " + name);
+    }
+    if (ftruncate(fd, static_cast<off_t>(page_size())) != 0) {
+      auto err = std::system_error(errno, std::generic_category(),
+                                   "ftruncate " + name);
+      close(fd);
+      shm_unlink(name.c_str());
+      throw err;
+    }
+    auto ptr =
+        mmap(nullptr, page_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+      auto err = std::system_error(errno, std::generic_category(),
+                                   "mmap " + name);
+      shm_unlink(name.c_str());
+      throw err;
+    }
+    hdr = static_cast<page_header *>(ptr);
+    slots = reinterpret_cast<slot *>(static_cast<uint8_t *>(ptr) + 64);
+    hdr->version = stats_version;
+    hdr->slot_num = static_cast<uint32_t>(slot_num);
+    hdr->publish_interval_ms = static_cast<uint64_t>(interval.count());
+    hdr->magic.store(stats_magic, std::memory_order_release);
+
+    publisher = std::thread([this]() {
+      std::unique_lock lk(page_mutex);
+      while (!stop_cv.wait_for(lk, interval, [this]() { return stopping; })) {
+        publish_locked();
+      }
+    });
+  }
+
+  stats_page::~stats_page() {
+    {
+      std::lock_guard lk(page_mutex);
+      stopping = true;
+    }
+    stop_cv.notify_all();
+    publisher.join();
+    if (munmap(hdr, page_size()) != 0) {
+      spdlog::error(
+          "munmap failed:{}",
+          std::make_error_code(static_cast<std::errc>(errno)).message());
+    }
+    shm_unlink(name.c_str());
+  }
+
+  std::unique_ptr<stats_page>
+  stats_page::open(std::string name_,
+                   std::chrono::milliseconds interval_) noexcept {
+    try {
+      return std::make_unique<stats_page>(std::move(name_), interval_);
+    } catch (const std::exception &e) {
+      spdlog::error("open stats page failed:{}", e.what());
+    }
+    return {};
+  }
+
+  bool stats_page::remove(const std::string &name) {
+    return shm_unlink(name.c_str()) == 0;
+  }
+
+  bool stats_page::add_pool(const pool &p) {
+    std::lock_guard lk(page_mutex);
+    auto it = std::find(pools.begin(), pools.end(), nullptr);
+    if (it == pools.end()) {
+      spdlog::warn("no free slot in stats page {}", name);
+      return false;
+    }
+    *it = &p;
+    publish_locked();
+    return true;
+  }
+
+  bool stats_page::remove_pool(const pool &p) {
+    std::lock_guard lk(page_mutex);
+    auto it = std::find(pools.begin(), pools.end(), &p);
+    if (it == pools.end()) {
+      return false;
+    }
+    *it = nullptr;
+    publish_locked();
+    return true;
+  }
+
+  void stats_page::publish() {
+    std::lock_guard lk(page_mutex);
+    publish_locked();
+  }
+
+  void stats_page::publish_locked() {
+    for (size_t i = 0; i < slot_num; i++) {
+      auto &s = slots[i];
+      auto p = pools[i];
+      if (!p && s.in_use == 0) {
+        continue;
+      }
+      snapshot data{};
+      if (p) {
+        auto st = p->get_statistics();
+        data.gpu_no = st.gpu_no;
+        data.used_bytes = st.used_bytes;
+        data.block_num = st.block_num;
+        data.cached_block_num = st.cached_block_num;
+        data.alloc_count = st.alloc_count;
+        data.free_count = st.free_count;
+        data.failure_count = st.failure_count;
+      }
+
+      //只有這個線程寫，所以sequence不需要原子加
+      auto seq = s.sequence.load(std::memory_order_relaxed);
+      s.sequence.store(seq + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      store_field(s.in_use, p != nullptr);
+      auto src = reinterpret_cast<const uint64_t *>(&data);
+      auto dst = reinterpret_cast<uint64_t *>(&s.data);
+      for (size_t j = 0; j < sizeof(snapshot) / sizeof(uint64_t); j++) {
+        store_field(dst[j], src[j]);
+      }
+      s.sequence.store(seq + 2, std::memory_order_release);
+    }
+  }
+
+  std::optional<std::vector<stats_page::snapshot>>
+  stats_page::read(const std::string &name) {
+    auto fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+      return {};
+    }
+    struct stat st {};
+    if (fstat(fd, &st) != 0 ||
+        static_cast<size_t>(st.st_size) < page_size()) {
+      close(fd);
+      return {};
+    }
+    auto ptr = mmap(nullptr, page_size(), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+      return {};
+    }
+    auto page_hdr = static_cast<const page_header *>(ptr);
+    auto page_slots = reinterpret_cast<const slot *>(
+        static_cast<const uint8_t *>(ptr) + 64);
+
+    std::optional<std::vector<snapshot>> res;
+    if (page_hdr->magic.load(std::memory_order_acquire) == stats_magic &&
+        page_hdr->version == stats_version) {
+      res.emplace();
+      for (size_t i = 0; i < std::min<size_t>(page_hdr->slot_num, slot_num);
+           i++) {
+        auto &s = page_slots[i];
+        snapshot data{};
+        uint64_t in_use{};
+        size_t retries = 0;
+        while (true) {
+          if (retries++ == max_read_retries) {
+            spdlog::warn("slot {} of stats page {} is being written too long",
+                         i, name);
+            res.reset();
+            break;
+          }
+          auto seq = s.sequence.load(std::memory_order_acquire);
+          if (seq % 2 != 0) {
+            std::this_thread::yield();
+            continue;
+          }
+          in_use = load_field(s.in_use);
+          auto src = reinterpret_cast<const uint64_t *>(&s.data);
+          auto dst = reinterpret_cast<uint64_t *>(&data);
+          for (size_t j = 0; j < sizeof(snapshot) / sizeof(uint64_t); j++) {
+            dst[j] = load_field(src[j]);
+          }
+          std::atomic_thread_fence(std::memory_order_acquire);
+          if (s.sequence.load(std::memory_order_relaxed) == seq) {
+            break;
+          }
+        }
+        if (!res) {
+          break;
+        }
+        if (in_use) {
+          res->push_back(data);
+        }
+      }
+    }
+    munmap(ptr, page_size());
+    return res;
+  }
+} // namespace cuda_buddy
@@ -0,0 +1,94 @@
+/*!
+ * \file stats_page.hpp
+ *
+ * \brief 把pool的統計定期寫到具名共享內存，供外部監控程序直接讀取
+ * \date 2026-10-17
+ */
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace cuda_buddy {
+
+  class pool;
+
+  //! 固定佈局的統計頁
+  /*!
+   * 後台線程每隔interval把登記的pool的統計寫入共享內存中的槽，
+   * 每個槽用seqlock保護，讀者不需要和這個進程通信，也不會阻塞寫者。
+   * 佈局見stats_page.cpp中的page_header和slot，監控程序可以用read讀取。
+   * 登記的pool必須在remove_pool之後或者stats_page析構之後才能析構。
+   * 同名的頁已經存在時構造失敗(EEXIST)，不會頂替其他進程的頁；
+   * 崩潰的進程留下的頁需要先用remove刪除。
+   */
+  class stats_page final {
+  public:
+    struct snapshot {
+      int64_t gpu_no;
+      uint64_t used_bytes;
+      uint64_t block_num;
+      uint64_t cached_block_num;
+      uint64_t alloc_count;
+      uint64_t free_count;
+      uint64_t failure_count;
+    };
+
+    stats_page(std::string name_, std::chrono::milliseconds interval_);
+
+    stats_page(const stats_page &) = delete;
+    stats_page &operator=(const stats_page &) = delete;
+
+    stats_page(stats_page &&rhs) = delete;
+    stats_page &operator=(stats_page &&rhs) = delete;
+
+    ~stats_page();
+
+    //! 不拋異常的版本，失敗時記錄錯誤並返回空指針
+    static std::unique_ptr<stats_page>
+    open(std::string name_, std::chrono::milliseconds interval_) noexcept;
+    static bool remove(const std::string &name);
+
+    //! 槽用完時返回false
+    bool add_pool(const pool &p);
+    bool remove_pool(const pool &p);
+
+    //! 立即寫入所有登記的pool的統計
+    void publish();
+
+    //! 監控程序使用，讀取名為name的統計頁中所有在用的槽。
+    //! 寫者停在寫槽的中途(例如崩潰)時重試有限次後返回空
+    static std::optional<std::vector<snapshot>>
+    read(const std::string &name);
+
+  public:
+    static constexpr size_t slot_num{64};
+    static constexpr size_t max_read_retries{1000};
+
+  private:
+    struct page_header;
+    struct slot;
+    static size_t page_size();
+    void publish_locked();
+
+  private:
+    std::string name;
+    std::chrono::milliseconds interval;
+    page_header *hdr{nullptr};
+    slot *slots{nullptr};
+    std::mutex page_mutex;
+    std::condition_variable stop_cv;
+    bool stopping{false};
+    std::vector<const pool *> pools;
+    std::thread publisher;
+  };
+
+} // namespace cuda_buddy
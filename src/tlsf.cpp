@@ -0,0 +1,246 @@
+/*!
+ * \file tlsf.cpp
+ *
+ * \brief 兩級分離適配(TLSF)分配器
+ * \date 2026-10-17
+ */
+
+#include <algorithm>
+#include <bit>
+#include <spdlog/spdlog.h>
+
+#include "tlsf.hpp"
+
+namespace cuda_buddy {
+
+  tlsf::tlsf(void *data_, size_t size_)
+      : data(static_cast<uint8_t *>(data_)), size(size_) {
+    for (auto &heads : free_heads) {
+      heads.fill(nil);
+    }
+    auto granule_num = size / min_block_size;
+    size = granule_num * min_block_size;
+    //構造時寫一遍，之後的分配不會因為第一次訪問元數據而缺頁
+    nodes.resize(granule_num);
+    states.assign(granule_num, granule_state::interior);
+    if (granule_num != 0) {
+      nodes[0] = {static_cast<uint32_t>(granule_num), nil, nil, nil};
+      insert_free(0);
+    }
+  }
+
+  size_t tlsf::block_size(size_t size, size_t alignment) {
+    if (size == 0) {
+      size = 1;
+    }
+    if (alignment > 1) {
+      size += alignment - 1;
+    }
+    return (size + min_block_size - 1) / min_block_size * min_block_size;
+  }
+
+  void tlsf::mapping(size_t size, size_t &fl, size_t &sl) {
+    fl = static_cast<size_t>(std::bit_width(size) - 1);
+    sl = (size >> (fl - sl_index_bits)) & (sl_index_num - 1);
+  }
+
+  uint32_t tlsf::find_suitable(size_t size) const {
+    //向上取整到下一個大小類，這個類中的任何塊都足夠大
+    auto fl = static_cast<size_t>(std::bit_width(size) - 1);
+    size += (1ULL << (fl - sl_index_bits)) - 1;
+    size_t sl = 0;
+    mapping(size, fl, sl);
+
+    auto sl_map = sl_bitmap[fl] & (~0U << sl);
+    if (sl_map == 0) {
+      auto fl_map =
+          (fl + 1 < fl_index_num) ? fl_bitmap & (~0ULL << (fl + 1)) : 0;
+      if (fl_map == 0) {
+        return nil;
+      }
+      fl = static_cast<size_t>(std::countr_zero(fl_map));
+      sl_map = sl_bitmap[fl];
+    }
+    sl = static_cast<size_t>(std::countr_zero(sl_map));
+    return free_heads[fl][sl];
+  }
+
+  void *tlsf::alloc(size_t size_, size_t alignment, size_t &alloced_size) {
+    alloced_size = 0;
+    if (size_ > size) {
+      spdlog::warn("too large size {}", size_);
+      return nullptr;
+    }
+    auto needed_size = block_size(size_, alignment);
+    if (needed_size > size) {
+      return nullptr;
+    }
+    auto index = find_suitable(needed_size);
+    if (index == nil) {
+      return nullptr;
+    }
+    remove_free(index);
+    auto needed = static_cast<uint32_t>(needed_size / min_block_size);
+    if (nodes[index].size > needed) {
+      auto rest = index + needed;
+      nodes[rest] = {nodes[index].size - needed, index, nil, nil};
+      if (auto next = next_phys(rest); next != nil) {
+        nodes[next].prev_phys = rest;
+      }
+      nodes[index].size = needed;
+      insert_free(rest);
+    }
+    states[index] = granule_state::used;
+    auto offset = static_cast<size_t>(index) * min_block_size;
+    used_size += node_bytes(index);
+    alloced_size = node_bytes(index);
+
+    auto ptr = data + offset;
+    if (alignment > 1) {
+      auto remainder = reinterpret_cast<uintptr_t>(ptr) % alignment;
+      if (remainder != 0) {
+        ptr += alignment - remainder;
+      }
+    }
+    nodes[index].next_free = static_cast<uint32_t>(ptr - data - offset);
+    auto granule = static_cast<uint32_t>((ptr - data) / min_block_size);
+    if (granule != index) {
+      states[granule] = granule_state::alias;
+      nodes[granule].size = index;
+    }
+    return ptr;
+  }
+
+  bool tlsf::free(void *ptr, size_t &freed_size) {
+    freed_size = 0;
+    auto offset = static_cast<uint8_t *>(ptr) - data;
+    if (offset < 0 || static_cast<size_t>(offset) >= size) {
+      spdlog::debug("tlsf can't free pointer out of range");
+      return false;
+    }
+    auto granule = static_cast<uint32_t>(offset / min_block_size);
+    auto index = granule;
+    if (states[granule] == granule_state::alias) {
+      index = nodes[granule].size;
+    }
+    if (states[index] != granule_state::used ||
+        static_cast<size_t>(index) * min_block_size + nodes[index].next_free !=
+            static_cast<size_t>(offset)) {
+      spdlog::debug("tlsf can't free unallocated pointer");
+      return false;
+    }
+    if (granule != index) {
+      states[granule] = granule_state::interior;
+    }
+    freed_size = node_bytes(index);
+    used_size -= freed_size;
+
+    auto next = next_phys(index);
+    if (next != nil && states[next] == granule_state::free) {
+      remove_free(next);
+      merge(index, next);
+    }
+    auto prev = nodes[index].prev_phys;
+    if (prev != nil && states[prev] == granule_state::free) {
+      remove_free(prev);
+      merge(prev, index);
+      index = prev;
+    }
+    insert_free(index);
+    return true;
+  }
+
+  size_t tlsf::largest_free() const {
+    if (fl_bitmap == 0) {
+      return 0;
+    }
+    auto fl = static_cast<size_t>(std::bit_width(fl_bitmap) - 1);
+    auto sl = static_cast<size_t>(std::bit_width(sl_bitmap[fl]) - 1);
+    size_t res = 0;
+    for (auto index = free_heads[fl][sl]; index != nil;
+         index = nodes[index].next_free) {
+      res = (std::max)(res, node_bytes(index));
+    }
+    return res;
+  }
+
+  std::vector<uint8_t> tlsf::occupancy(size_t resolution) const {
+    if (resolution == 0 || size == 0) {
+      return {};
+    }
+    auto bucket_size = size / resolution;
+    std::vector<size_t> used_bytes(resolution, 0);
+    //偏移0的節點不會被合併掉，總是第一個
+    for (uint32_t index = 0; index != nil; index = next_phys(index)) {
+      if (states[index] != granule_state::used) {
+        continue;
+      }
+      auto begin_offset = static_cast<size_t>(index) * min_block_size;
+      auto end = begin_offset + node_bytes(index);
+      for (auto i = begin_offset / bucket_size;
+           i < resolution && i * bucket_size < end; i++) {
+        auto begin = (std::max)(begin_offset, i * bucket_size);
+        used_bytes[i] += (std::min)(end, (i + 1) * bucket_size) - begin;
+      }
+    }
+    std::vector<uint8_t> res(resolution);
+    for (size_t i = 0; i < resolution; i++) {
+      res[i] = static_cast<uint8_t>((used_bytes[i] * 255 + bucket_size - 1) /
+                                    bucket_size);
+    }
+    return res;
+  }
+
+  uint32_t tlsf::next_phys(uint32_t index) const {
+    auto next = static_cast<size_t>(index) + nodes[index].size;
+    return next < nodes.size() ? static_cast<uint32_t>(next) : nil;
+  }
+
+  void tlsf::insert_free(uint32_t index) {
+    size_t fl = 0;
+    size_t sl = 0;
+    mapping(node_bytes(index), fl, sl);
+    auto head = free_heads[fl][sl];
+    states[index] = granule_state::free;
+    nodes[index].prev_free = nil;
+    nodes[index].next_free = head;
+    if (head != nil) {
+      nodes[head].prev_free = index;
+    }
+    free_heads[fl][sl] = index;
+    fl_bitmap |= 1ULL << fl;
+    sl_bitmap[fl] |= 1U << sl;
+  }
+
+  void tlsf::remove_free(uint32_t index) {
+    size_t fl = 0;
+    size_t sl = 0;
+    mapping(node_bytes(index), fl, sl);
+    auto prev = nodes[index].prev_free;
+    auto next = nodes[index].next_free;
+    if (prev != nil) {
+      nodes[prev].next_free = next;
+    }
+    if (next != nil) {
+      nodes[next].prev_free = prev;
+    }
+    if (free_heads[fl][sl] == index) {
+      free_heads[fl][sl] = next;
+      if (next == nil) {
+        sl_bitmap[fl] &= ~(1U << sl);
+        if (sl_bitmap[fl] == 0) {
+          fl_bitmap &= ~(1ULL << fl);
+        }
+      }
+    }
+    states[index] = granule_state::interior;
+  }
+
+  void tlsf::merge(uint32_t index, uint32_t next) {
+    nodes[index].size += nodes[next].size;
+    states[next] = granule_state::interior;
+    if (auto next_next = next_phys(index); next_next != nil) {
+      nodes[next_next].prev_phys = index;
+    }
+  }
+} // namespace cuda_buddy
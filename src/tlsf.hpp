@@ -0,0 +1,99 @@
+/*!
+ * \file tlsf.hpp
+ *
+ * \brief 兩級分離適配(TLSF)分配器
+ * \date 2026-10-17
+ */
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace cuda_buddy {
+
+  //! 管理一段連續內存的TLSF分配器
+  /*!
+   * 元數據全部放在host內存中，不讀寫被管理的內存，所以也可以管理設備內存。
+   * 分配和釋放都是O(1)，大小只按min_block_size取整，內部碎片比buddy少。
+   * 每min_block_size字節一項元數據(17字節)，構造時一次分配好，
+   * 之後分配和釋放不再申請堆內存。
+   * 不是線程安全的，由allocator的鎖保護。
+   */
+  class tlsf final {
+  public:
+    tlsf(void *data_, size_t size_);
+
+    tlsf(const tlsf &) = delete;
+    tlsf &operator=(const tlsf &) = delete;
+
+    tlsf(tlsf &&rhs) = delete;
+    tlsf &operator=(tlsf &&rhs) = delete;
+
+    ~tlsf() = default;
+
+    //! alloced_size返回實際佔用的字節數
+    void *alloc(size_t size, size_t alignment, size_t &alloced_size);
+    //! freed_size返回釋放的字節數
+    bool free(void *ptr, size_t &freed_size);
+
+    size_t used_bytes() const { return used_size; }
+    size_t largest_free() const;
+    //! 和allocator::occupancy相同，resolution是2的冪且不超過size
+    std::vector<uint8_t> occupancy(size_t resolution) const;
+
+    //! alloc(size,alignment)實際佔用的字節數
+    static size_t block_size(size_t size, size_t alignment);
+
+  public:
+    static constexpr size_t min_block_size{256};
+    static constexpr size_t sl_index_bits{5};
+
+  private:
+    static constexpr uint32_t nil{UINT32_MAX};
+    static constexpr size_t fl_index_num{64};
+    static constexpr size_t sl_index_num{1ULL << sl_index_bits};
+
+    //! 節點的下標是它起始的粒度(min_block_size)序號
+    struct node final {
+      //! 以粒度為單位的大小；別名項中是所屬節點的下標
+      uint32_t size;
+      //! 地址相鄰的前一個節點
+      uint32_t prev_phys;
+      //! 空閒時是同一個大小類的空閒鏈表；使用中next_free是
+      //! 返回的指針相對節點起點的偏移
+      uint32_t prev_free;
+      uint32_t next_free;
+    };
+    enum class granule_state : uint8_t {
+      //! 不是節點的起點
+      interior,
+      free,
+      used,
+      //! 對齊後返回的指針落在所屬節點的這個粒度中
+      alias,
+    };
+
+    static void mapping(size_t size, size_t &fl, size_t &sl);
+    uint32_t find_suitable(size_t size) const;
+    size_t node_bytes(uint32_t index) const {
+      return static_cast<size_t>(nodes[index].size) * min_block_size;
+    }
+    uint32_t next_phys(uint32_t index) const;
+    void insert_free(uint32_t index);
+    void remove_free(uint32_t index);
+    void merge(uint32_t index, uint32_t next);
+
+  private:
+    uint8_t *data{nullptr};
+    size_t size{};
+    size_t used_size{};
+    uint64_t fl_bitmap{};
+    std::array<uint32_t, fl_index_num> sl_bitmap{};
+    std::array<std::array<uint32_t, sl_index_num>, fl_index_num> free_heads;
+    std::vector<node> nodes;
+    std::vector<granule_state> states;
+  };
+
+} // namespace cuda_buddy
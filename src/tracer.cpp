@@ -0,0 +1,181 @@
+/*!
+ * \file tracer.cpp
+ *
+ * \brief 記錄分配器的活動，導出成Chrome trace
+ * \date 2026-10-17
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <spdlog/spdlog.h>
+#include <vector>
+
+#include "tracer.hpp"
+
+namespace cuda_buddy {
+
+  namespace {
+    struct ring_buffer final {
+      explicit ring_buffer(size_t capacity, uint64_t generation_,
+                           uint32_t tid_)
+          : events(capacity), generation(generation_), tid(tid_) {}
+      std::vector<tracer::event> events;
+      //! 寫入的事件總數，只由所屬線程增加
+      std::atomic<size_t> event_num{0};
+      uint64_t generation;
+      uint32_t tid;
+    };
+
+    std::mutex buffer_mutex;
+    std::vector<std::shared_ptr<ring_buffer>> buffers;
+    size_t buffer_capacity{1 << 16};
+    std::atomic<uint64_t> generation{0};
+
+    thread_local std::shared_ptr<ring_buffer> local_buffer;
+
+    ring_buffer &get_local_buffer() {
+      std::lock_guard lk(buffer_mutex);
+      if (!local_buffer || local_buffer->generation != generation) {
+        local_buffer = std::make_shared<ring_buffer>(
+            buffer_capacity, generation, static_cast<uint32_t>(buffers.size()));
+        buffers.push_back(local_buffer);
+      }
+      return *local_buffer;
+    }
+
+    const char *event_name(tracer::event_type type) {
+      switch (type) {
+        case tracer::event_type::alloc:
+          return "alloc";
+        case tracer::event_type::free:
+          return "free";
+        case tracer::event_type::get_block:
+          return "get_block";
+        case tracer::event_type::release:
+          return "release";
+        case tracer::event_type::lock_wait:
+          return "global_pool_lock_wait";
+        case tracer::event_type::sync_stream:
+          return "sync_stream";
+        case tracer::event_type::usage:
+          return "used_bytes";
+      }
+      return "unknown";
+    }
+
+    // Chrome trace的pid必須是非負整數，host用0，GPU n用n+1
+    int trace_pid(int gpu_no) { return gpu_no < 0 ? 0 : gpu_no + 1; }
+  } // namespace
+
+  uint64_t tracer::now_ns() {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+  }
+
+  void tracer::start(size_t events_per_thread) {
+    std::lock_guard lk(buffer_mutex);
+    buffers.clear();
+    buffer_capacity = (std::max)(events_per_thread, static_cast<size_t>(1));
+    generation++;
+    active.store(true);
+  }
+
+  void tracer::stop() { active.store(false); }
+
+  void tracer::record(const event &e) {
+    if (!enabled()) {
+      return;
+    }
+    auto buffer = local_buffer.get();
+    if (!buffer || buffer->generation != generation) {
+      buffer = &get_local_buffer();
+    }
+    auto num = buffer->event_num.load(std::memory_order_relaxed);
+    buffer->events[num % buffer->events.size()] = e;
+    buffer->event_num.store(num + 1, std::memory_order_release);
+  }
+
+  void tracer::write_chrome_trace(std::ostream &os) {
+    std::lock_guard lk(buffer_mutex);
+    auto flags = os.flags();
+    auto precision = os.precision();
+    // ts和dur以微秒為單位，保留到納秒
+    os << std::fixed << std::setprecision(3);
+    os << "{\"traceEvents\":[";
+    bool first = true;
+    auto separator = [&]() {
+      if (!first) {
+        os << ",\n";
+      }
+      first = false;
+    };
+
+    std::set<int> gpus;
+    for (const auto &buffer : buffers) {
+      auto num = buffer->event_num.load(std::memory_order_acquire);
+      auto capacity = buffer->events.size();
+      for (auto i = num > capacity ? num - capacity : 0; i < num; i++) {
+        const auto &e = buffer->events[i % capacity];
+        auto pid = trace_pid(e.gpu_no);
+        gpus.insert(e.gpu_no);
+        separator();
+        os << "{\"name\":\"" << event_name(e.type) << "\",\"pid\":" << pid
+           << ",\"tid\":" << buffer->tid
+           << ",\"ts\":" << static_cast<double>(e.start_ns) / 1000;
+        switch (e.type) {
+          case event_type::usage:
+            os << ",\"ph\":\"C\",\"args\":{\"pool " << e.pool
+               << "\":" << e.arg0 << "}}";
+            continue;
+          case event_type::alloc:
+            os << ",\"args\":{\"size\":" << e.arg0 << ",\"ptr\":\""
+               << reinterpret_cast<const void *>(e.arg1) << "\"}";
+            break;
+          case event_type::free:
+            os << ",\"args\":{\"ptr\":\""
+               << reinterpret_cast<const void *>(e.arg0) << "\"}";
+            break;
+          case event_type::get_block:
+            os << ",\"args\":{\"block_id\":" << e.arg0
+               << ",\"new_block\":" << e.arg1 << "}";
+            break;
+          case event_type::release:
+            os << ",\"args\":{\"released_block_num\":" << e.arg0 << "}";
+            break;
+          default:
+            break;
+        }
+        os << ",\"ph\":\"X\",\"dur\":"
+           << static_cast<double>(e.duration_ns) / 1000 << "}";
+      }
+    }
+    for (auto gpu_no : gpus) {
+      separator();
+      os << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":"
+         << trace_pid(gpu_no) << ",\"args\":{\"name\":\""
+         << (gpu_no < 0 ? std::string("host")
+                        : "gpu " + std::to_string(gpu_no))
+         << "\"}}";
+    }
+    os << "]}\n";
+    os.flags(flags);
+    os.precision(precision);
+  }
+
+  bool tracer::export_chrome_trace(const std::string &path) {
+    std::ofstream os(path);
+    if (!os) {
+      spdlog::error("can't open {}", path);
+      return false;
+    }
+    write_chrome_trace(os);
+    return static_cast<bool>(os);
+  }
+} // namespace cuda_buddy
@@ -0,0 +1,60 @@
+/*!
+ * \file tracer.hpp
+ *
+ * \brief 記錄分配器的活動，導出成Chrome trace
+ * \date 2026-10-17
+ */
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+namespace cuda_buddy {
+
+  //! 可選的時間線記錄
+  /*!
+   * start之後各線程把事件寫進自己的環形緩沖區，滿了覆蓋最舊的事件。
+   * stop之後可以導出成Chrome trace JSON，用chrome://tracing或Perfetto UI打開。
+   * 未啓用時每個記錄點只有一次relaxed讀取。
+   */
+  class tracer final {
+  public:
+    enum class event_type : uint8_t {
+      alloc,
+      free,
+      get_block,
+      release,
+      lock_wait,
+      sync_stream,
+      usage,
+    };
+    struct event final {
+      event_type type;
+      int gpu_no;
+      const void *pool;
+      uint64_t start_ns;
+      uint64_t duration_ns;
+      //! alloc:大小和指針 free:指針 get_block:塊編號和是否新建
+      //! release:歸還塊數 usage:使用的字節數
+      uint64_t arg0;
+      uint64_t arg1;
+    };
+
+    static void start(size_t events_per_thread = 1 << 16);
+    static void stop();
+    static bool enabled() { return active.load(std::memory_order_relaxed); }
+    static void record(const event &e);
+
+    static void write_chrome_trace(std::ostream &os);
+    static bool export_chrome_trace(const std::string &path);
+
+    static uint64_t now_ns();
+
+  private:
+    static inline std::atomic<bool> active{false};
+  };
+
+} // namespace cuda_buddy
@@ -1,6 +1,10 @@
+#include <algorithm>
+#include <atomic>
 #include <cuda_runtime.h>
 #include <cuda_runtime_api.h>
 #include <doctest/doctest.h>
+#include <thread>
+#include <vector>
 
 #include "../src/allocator.hpp"
 
@@ -53,6 +57,171 @@ namespace {
         }
       }
 
+      SUBCASE("capacity queries") {
+        REQUIRE(buddy_allocator.largest_free() == 8);
+        REQUIRE(buddy_allocator.free_bytes() == 8);
+
+        auto ptr = buddy_allocator.alloc(1);
+        REQUIRE(ptr);
+        REQUIRE(buddy_allocator.largest_free() == 4);
+        REQUIRE(buddy_allocator.free_bytes() == 7);
+        REQUIRE(buddy_allocator.can_alloc(4, 1));
+        REQUIRE(!buddy_allocator.can_alloc(4, 2));
+
+        auto ptr2 = buddy_allocator.alloc(4);
+        REQUIRE(ptr2);
+        REQUIRE(buddy_allocator.largest_free() == 2);
+
+        REQUIRE(buddy_allocator.free(ptr2));
+        REQUIRE(buddy_allocator.free(ptr));
+        REQUIRE(buddy_allocator.largest_free() == 8);
+        REQUIRE(buddy_allocator.can_alloc(8, 1));
+      }
+
+      SUBCASE("occupancy") {
+        auto ptr = buddy_allocator.alloc(1);
+        REQUIRE(ptr);
+        auto ptr2 = buddy_allocator.alloc(4);
+        REQUIRE(ptr2);
+        std::vector<uint8_t> expected{128, 0, 255, 255};
+        REQUIRE(buddy_allocator.occupancy(4) == expected);
+        REQUIRE(buddy_allocator.occupancy(16).size() == 8);
+        REQUIRE(buddy_allocator.occupancy(0).empty());
+
+        REQUIRE(buddy_allocator.free(ptr2));
+        REQUIRE(buddy_allocator.free(ptr));
+        expected.assign(2, 0);
+        REQUIRE(buddy_allocator.occupancy(2) == expected);
+      }
+
+      SUBCASE("alloc and free by node") {
+        auto index = buddy_allocator.alloc_node(2);
+        REQUIRE(index != cuda_buddy::allocator::npos);
+        auto index2 = buddy_allocator.alloc_node(4);
+        REQUIRE(index2 != cuda_buddy::allocator::npos);
+        auto ptr = buddy_allocator.node_address(index);
+        auto ptr2 = buddy_allocator.node_address(index2);
+        REQUIRE(buddy_allocator.in_buddy(ptr));
+        REQUIRE(static_cast<uint8_t *>(ptr2) - static_cast<uint8_t *>(ptr) ==
+                4);
+
+        REQUIRE(buddy_allocator.free_node(index));
+        REQUIRE(!buddy_allocator.free_node(index));
+        REQUIRE(buddy_allocator.free(ptr2));
+        REQUIRE(!buddy_allocator.free_node(index2));
+        REQUIRE(buddy_allocator.full());
+      }
+
+      SUBCASE("presplit") {
+        REQUIRE(buddy_allocator.presplit(0, 3) == 4);
+        //切分出的兄弟還能合併
+        REQUIRE(buddy_allocator.largest_free() == 8);
+        REQUIRE(buddy_allocator.free_bytes() == 8);
+        REQUIRE(buddy_allocator.presplit(3, 1) == 0);
+
+        std::vector<void *> ptrs;
+        for (auto size : {4u, 1u, 1u, 1u, 1u}) {
+          auto ptr = buddy_allocator.alloc(size);
+          REQUIRE(ptr);
+          ptrs.push_back(ptr);
+        }
+        REQUIRE(!buddy_allocator.alloc(1));
+        for (auto &ptr : ptrs) {
+          REQUIRE(buddy_allocator.free(ptr));
+        }
+        REQUIRE(buddy_allocator.largest_free() == 8);
+        //釋放時保留的節點沒有被合併，不需要再切分
+        REQUIRE(buddy_allocator.presplit(0, 3) == 4);
+        //整塊的分配合併保留的節點
+        auto ptr = buddy_allocator.alloc(8);
+        REQUIRE(ptr);
+        REQUIRE(buddy_allocator.free(ptr));
+        buddy_allocator.clear_presplit();
+        REQUIRE(buddy_allocator.full());
+      }
+
+      SUBCASE("best fit") {
+        buddy_allocator.set_fit_policy(cuda_buddy::fit_policy::best_fit);
+        auto base = static_cast<uint8_t *>(buddy_allocator.alloc(4));
+        REQUIRE(base);
+        auto ptr = buddy_allocator.alloc(1);
+        REQUIRE(ptr == base + 4);
+        auto ptr2 = buddy_allocator.alloc(1);
+        REQUIRE(ptr2 == base + 5);
+        REQUIRE(buddy_allocator.free(base));
+        REQUIRE(buddy_allocator.free(ptr2));
+
+        //左邊未切分的4字節節點保留下來
+        ptr2 = buddy_allocator.alloc(1);
+        REQUIRE(ptr2 == base + 5);
+        REQUIRE(buddy_allocator.largest_free() == 4);
+        auto ptr3 = buddy_allocator.alloc(2);
+        REQUIRE(ptr3 == base + 6);
+        REQUIRE(buddy_allocator.alloc(4) == base);
+        REQUIRE(!buddy_allocator.alloc(1));
+
+        REQUIRE(buddy_allocator.free(base));
+        REQUIRE(buddy_allocator.free(ptr));
+        REQUIRE(buddy_allocator.free(ptr2));
+        REQUIRE(buddy_allocator.free(ptr3));
+        REQUIRE(buddy_allocator.full());
+        REQUIRE(buddy_allocator.largest_free() == 8);
+      }
+
+      SUBCASE("lazy coalescing") {
+        buddy_allocator.set_lazy_coalescing(2);
+        auto base = static_cast<uint8_t *>(buddy_allocator.alloc(1));
+        REQUIRE(base);
+        REQUIRE(buddy_allocator.free(base));
+        //沒有合併，同樣大小的分配直接用這個節點，largest_free按合併後計算
+        REQUIRE(buddy_allocator.largest_free() == 8);
+        REQUIRE(buddy_allocator.can_alloc(8, 1));
+        REQUIRE(buddy_allocator.alloc(1) == base);
+        auto ptr = buddy_allocator.alloc(1);
+        REQUIRE(ptr == base + 1);
+        REQUIRE(buddy_allocator.free(base));
+        REQUIRE(buddy_allocator.free(ptr));
+        REQUIRE(buddy_allocator.largest_free() == 8);
+
+        //分配失敗時合併整棵樹
+        REQUIRE(buddy_allocator.alloc(8) == base);
+        REQUIRE(buddy_allocator.free(base));
+        REQUIRE(buddy_allocator.largest_free() == 8);
+
+        //空閒節點達到上限後照常合併
+        buddy_allocator.set_lazy_coalescing(1);
+        ptr = buddy_allocator.alloc(1);
+        REQUIRE(ptr == base);
+        REQUIRE(buddy_allocator.free(ptr));
+        REQUIRE(buddy_allocator.largest_free() == 8);
+        buddy_allocator.set_lazy_coalescing(0);
+      }
+
+      SUBCASE("search hint") {
+        auto base = static_cast<uint8_t *>(buddy_allocator.alloc(1));
+        REQUIRE(base);
+        for (size_t i = 1; i < 8; i++) {
+          REQUIRE(buddy_allocator.alloc(1) == base + i);
+        }
+        REQUIRE(!buddy_allocator.alloc(1));
+        //釋放後查找起點回退，仍然返回最左的可用節點
+        REQUIRE(buddy_allocator.free(base + 5));
+        REQUIRE(buddy_allocator.free(base + 2));
+        REQUIRE(buddy_allocator.alloc(1) == base + 2);
+        REQUIRE(buddy_allocator.free(base + 4));
+        REQUIRE(buddy_allocator.alloc(2) == base + 4);
+        REQUIRE(!buddy_allocator.alloc(1));
+        REQUIRE(buddy_allocator.free(base + 4));
+        for (size_t i = 0; i < 8; i++) {
+          if (i != 4 && i != 5) {
+            REQUIRE(buddy_allocator.free(base + i));
+          }
+        }
+        REQUIRE(buddy_allocator.full());
+        REQUIRE(buddy_allocator.alloc(8) == base);
+        REQUIRE(buddy_allocator.free(base));
+      }
+
       SUBCASE("full alloc") {
         auto ptr = buddy_allocator.alloc(8);
         REQUIRE(ptr);
@@ -67,3 +236,273 @@ namespace {
 
 TEST_CASE("host") { real_test(cuda_buddy::alloc_location::host); }
 TEST_CASE("device") { real_test(cuda_buddy::alloc_location::device); }
+
+TEST_CASE("wide index") {
+  constexpr uint8_t max_level = 12;
+  cuda_buddy::allocator plain_allocator(max_level,
+                                        cuda_buddy::alloc_location::host);
+  cuda_buddy::allocator indexed_allocator(max_level,
+                                          cuda_buddy::alloc_location::host);
+  REQUIRE(indexed_allocator.set_wide_index(true));
+
+  //索引只加快查找，first_fit選中的節點和逐個遍歷相同
+  auto check_same = [&](uint8_t *plain_ptr, uint8_t *indexed_ptr) {
+    REQUIRE((plain_ptr == nullptr) == (indexed_ptr == nullptr));
+    if (plain_ptr) {
+      REQUIRE(plain_ptr -
+                  static_cast<uint8_t *>(plain_allocator.node_address(0)) ==
+              indexed_ptr -
+                  static_cast<uint8_t *>(indexed_allocator.node_address(0)));
+    }
+  };
+  std::vector<std::pair<uint8_t *, uint8_t *>> ptrs;
+  unsigned seed = 1;
+  for (size_t i = 0; i < 3000; i++) {
+    seed = seed * 1103515245 + 12345;
+    if (i == 1000) {
+      plain_allocator.set_lazy_coalescing(4);
+      indexed_allocator.set_lazy_coalescing(4);
+    } else if (i == 2000) {
+      plain_allocator.set_lazy_coalescing(0);
+      indexed_allocator.set_lazy_coalescing(0);
+    }
+    if (!ptrs.empty() && (seed >> 16) % 3 == 0) {
+      auto pos = (seed >> 8) % ptrs.size();
+      REQUIRE(plain_allocator.free(ptrs[pos].first));
+      REQUIRE(indexed_allocator.free(ptrs[pos].second));
+      ptrs.erase(ptrs.begin() + static_cast<std::ptrdiff_t>(pos));
+      continue;
+    }
+    auto size = 1 + (seed >> 20) % ((seed >> 12) % 4 == 0 ? 1000 : 50);
+    auto plain_ptr = static_cast<uint8_t *>(plain_allocator.alloc(size));
+    auto indexed_ptr = static_cast<uint8_t *>(indexed_allocator.alloc(size));
+    check_same(plain_ptr, indexed_ptr);
+    if (plain_ptr) {
+      ptrs.emplace_back(plain_ptr, indexed_ptr);
+    }
+  }
+  CHECK(plain_allocator.largest_free() == indexed_allocator.largest_free());
+  for (auto [plain_ptr, indexed_ptr] : ptrs) {
+    REQUIRE(plain_allocator.free(plain_ptr));
+    REQUIRE(indexed_allocator.free(indexed_ptr));
+  }
+  REQUIRE(indexed_allocator.full());
+  REQUIRE(indexed_allocator.alloc(1ULL << max_level));
+  REQUIRE(!indexed_allocator.alloc(1));
+  CHECK(indexed_allocator.set_wide_index(false));
+
+  cuda_buddy::allocator small_allocator(3, cuda_buddy::alloc_location::host);
+  CHECK(!small_allocator.set_wide_index(true));
+  cudaDeviceReset();
+}
+
+TEST_CASE("lock stripes") {
+  constexpr uint8_t max_level = 12;
+  cuda_buddy::allocator buddy_allocator(max_level,
+                                        cuda_buddy::alloc_location::host);
+  REQUIRE(!buddy_allocator.set_lock_stripes(3));
+  REQUIRE(buddy_allocator.set_lock_stripes(8));
+  REQUIRE(buddy_allocator.lock_stripes() == 8);
+  //條帶之上的節點保持切分，全部空閒時仍然可以分配整個塊
+  REQUIRE(buddy_allocator.largest_free() == (1ULL << max_level));
+  auto whole = buddy_allocator.alloc(1ULL << max_level);
+  REQUIRE(whole);
+  REQUIRE(!buddy_allocator.alloc(1));
+  REQUIRE(buddy_allocator.largest_free() == 0);
+  REQUIRE(buddy_allocator.free(whole));
+  REQUIRE(buddy_allocator.full());
+
+  constexpr size_t stripe_size = (1ULL << max_level) / 8;
+  auto small = static_cast<uint8_t *>(buddy_allocator.alloc(1));
+  REQUIRE(small);
+  CHECK(buddy_allocator.largest_free() == (1ULL << max_level) / 2);
+  auto big = static_cast<uint8_t *>(buddy_allocator.alloc(stripe_size * 2));
+  REQUIRE(big);
+  CHECK((big - small >= static_cast<std::ptrdiff_t>(stripe_size) ||
+         small - big >= static_cast<std::ptrdiff_t>(stripe_size * 2)));
+  REQUIRE(buddy_allocator.free(big));
+  REQUIRE(buddy_allocator.free(small));
+  REQUIRE(buddy_allocator.full());
+
+  //多個線程並發分配和釋放，寫入的內容不能被其他分配覆蓋
+  std::vector<std::thread> threads;
+  std::atomic<size_t> errors{0};
+  for (unsigned thread_id = 1; thread_id <= 4; thread_id++) {
+    threads.emplace_back([&buddy_allocator, &errors, thread_id]() {
+      std::vector<std::pair<uint8_t *, size_t>> ptrs;
+      unsigned seed = thread_id;
+      for (size_t i = 0; i < 5000; i++) {
+        seed = seed * 1103515245 + 12345;
+        if (!ptrs.empty() && (seed >> 16) % 2 == 0) {
+          auto [ptr, size] = ptrs.back();
+          ptrs.pop_back();
+          for (size_t j = 0; j < size; j++) {
+            if (ptr[j] != thread_id) {
+              errors++;
+              break;
+            }
+          }
+          if (!buddy_allocator.free(ptr)) {
+            errors++;
+          }
+          continue;
+        }
+        auto size = 1 + (seed >> 20) % ((seed >> 12) % 16 == 0 ? 1024 : 64);
+        auto ptr = static_cast<uint8_t *>(buddy_allocator.alloc(size));
+        if (ptr) {
+          std::fill(ptr, ptr + size, static_cast<uint8_t>(thread_id));
+          ptrs.emplace_back(ptr, size);
+        }
+      }
+      for (auto [ptr, size] : ptrs) {
+        if (!buddy_allocator.free(ptr)) {
+          errors++;
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  CHECK(errors == 0);
+  REQUIRE(buddy_allocator.full());
+  REQUIRE(buddy_allocator.set_lock_stripes(0));
+  REQUIRE(buddy_allocator.alloc(1ULL << max_level));
+  cudaDeviceReset();
+}
+
+TEST_CASE("optimistic search") {
+  constexpr uint8_t max_level = 12;
+  cuda_buddy::allocator plain(max_level, cuda_buddy::alloc_location::host);
+  cuda_buddy::allocator buddy_allocator(max_level,
+                                        cuda_buddy::alloc_location::host);
+  REQUIRE(buddy_allocator.set_optimistic_search(true));
+  REQUIRE(!buddy_allocator.set_lock_stripes(8));
+  REQUIRE(!buddy_allocator.set_wide_index(true));
+
+  //單線程時查找期間沒有寫入，結果和加鎖查找相同
+  std::vector<std::pair<uint8_t *, uint8_t *>> ptrs;
+  unsigned seed = 1;
+  for (size_t i = 0; i < 3000; i++) {
+    seed = seed * 1103515245 + 12345;
+    if (!ptrs.empty() && (seed >> 16) % 3 == 0) {
+      auto pos = (seed >> 8) % ptrs.size();
+      REQUIRE(plain.free(ptrs[pos].first));
+      REQUIRE(buddy_allocator.free(ptrs[pos].second));
+      ptrs.erase(ptrs.begin() + static_cast<std::ptrdiff_t>(pos));
+      continue;
+    }
+    auto size = 1 + (seed >> 20) % 200;
+    auto ptr = static_cast<uint8_t *>(plain.alloc(size));
+    auto optimistic_ptr = static_cast<uint8_t *>(buddy_allocator.alloc(size));
+    REQUIRE((ptr == nullptr) == (optimistic_ptr == nullptr));
+    if (ptr) {
+      REQUIRE(ptr - static_cast<uint8_t *>(plain.node_address(0)) ==
+              optimistic_ptr -
+                  static_cast<uint8_t *>(buddy_allocator.node_address(0)));
+      ptrs.emplace_back(ptr, optimistic_ptr);
+    }
+  }
+  for (auto [ptr, optimistic_ptr] : ptrs) {
+    REQUIRE(plain.free(ptr));
+    REQUIRE(buddy_allocator.free(optimistic_ptr));
+  }
+  REQUIRE(buddy_allocator.full());
+
+  //並發時候選節點可能被搶走，寫入的內容不能被其他分配覆蓋
+  std::vector<std::thread> threads;
+  std::atomic<size_t> errors{0};
+  for (unsigned thread_id = 1; thread_id <= 4; thread_id++) {
+    threads.emplace_back([&buddy_allocator, &errors, thread_id]() {
+      std::vector<std::pair<uint8_t *, size_t>> thread_ptrs;
+      unsigned thread_seed = thread_id;
+      for (size_t i = 0; i < 5000; i++) {
+        thread_seed = thread_seed * 1103515245 + 12345;
+        if (!thread_ptrs.empty() && (thread_seed >> 16) % 2 == 0) {
+          auto [ptr, size] = thread_ptrs.back();
+          thread_ptrs.pop_back();
+          for (size_t j = 0; j < size; j++) {
+            if (ptr[j] != thread_id) {
+              errors++;
+              break;
+            }
+          }
+          if (!buddy_allocator.free(ptr)) {
+            errors++;
+          }
+          continue;
+        }
+        auto size = 1 + (thread_seed >> 20) % 64;
+        auto ptr = static_cast<uint8_t *>(buddy_allocator.alloc(size));
+        if (ptr) {
+          std::fill(ptr, ptr + size, static_cast<uint8_t>(thread_id));
+          thread_ptrs.emplace_back(ptr, size);
+        }
+      }
+      for (auto [ptr, size] : thread_ptrs) {
+        if (!buddy_allocator.free(ptr)) {
+          errors++;
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  CHECK(errors == 0);
+  REQUIRE(buddy_allocator.full());
+  REQUIRE(buddy_allocator.set_optimistic_search(false));
+  REQUIRE(buddy_allocator.set_lock_stripes(8));
+  cudaDeviceReset();
+}
+
+TEST_CASE("lock policy") {
+  constexpr uint8_t max_level = 12;
+  cuda_buddy::allocator buddy_allocator(max_level,
+                                        cuda_buddy::alloc_location::host);
+  REQUIRE(buddy_allocator.locking() == cuda_buddy::lock_policy::shared);
+  REQUIRE(buddy_allocator.set_lock_policy(cuda_buddy::lock_policy::none));
+  //條帶鎖需要共享模式
+  REQUIRE(!buddy_allocator.set_lock_stripes(8));
+  auto ptr = buddy_allocator.alloc(100);
+  REQUIRE(ptr);
+  REQUIRE(buddy_allocator.free(ptr));
+  REQUIRE(buddy_allocator.full());
+
+  for (auto policy :
+       {cuda_buddy::lock_policy::spin, cuda_buddy::lock_policy::futex}) {
+    REQUIRE(buddy_allocator.set_lock_policy(policy));
+    REQUIRE(buddy_allocator.locking() == policy);
+    std::vector<std::thread> threads;
+    std::atomic<size_t> errors{0};
+    for (unsigned thread_id = 1; thread_id <= 4; thread_id++) {
+      threads.emplace_back([&buddy_allocator, &errors, thread_id]() {
+        for (size_t i = 0; i < 2000; i++) {
+          auto size = 1 + (i * thread_id) % 64;
+          auto thread_ptr = static_cast<uint8_t *>(buddy_allocator.alloc(size));
+          if (!thread_ptr) {
+            continue;
+          }
+          std::fill(thread_ptr, thread_ptr + size,
+                    static_cast<uint8_t>(thread_id));
+          if (std::count(thread_ptr, thread_ptr + size,
+                         static_cast<uint8_t>(thread_id)) !=
+                  static_cast<std::ptrdiff_t>(size) ||
+              !buddy_allocator.free(thread_ptr)) {
+            errors++;
+          }
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    CHECK(errors == 0);
+    REQUIRE(buddy_allocator.full());
+  }
+
+  REQUIRE(buddy_allocator.set_lock_policy(cuda_buddy::lock_policy::shared));
+  REQUIRE(buddy_allocator.set_lock_stripes(8));
+  REQUIRE(!buddy_allocator.set_lock_policy(cuda_buddy::lock_policy::spin));
+  cudaDeviceReset();
+}
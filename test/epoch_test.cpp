@@ -0,0 +1,33 @@
+#include <atomic>
+#include <chrono>
+#include <doctest/doctest.h>
+#include <thread>
+
+#include "../src/epoch.hpp"
+
+using cuda_buddy::epoch;
+
+TEST_CASE("synchronize") {
+  auto start_epoch = epoch::current();
+  epoch::synchronize();
+  CHECK(epoch::current() == start_epoch + 1);
+
+  //讀區間結束前synchronize不能返回
+  std::atomic<bool> entered{false};
+  std::atomic<bool> left{false};
+  std::thread reader_thread([&]() {
+    epoch::guard reader;
+    {
+      epoch::guard nested_reader;
+    }
+    entered = true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    left = true;
+  });
+  while (!entered) {
+    std::this_thread::yield();
+  }
+  epoch::synchronize();
+  CHECK(left);
+  reader_thread.join();
+}
@@ -0,0 +1,108 @@
+#include <cstring>
+#include <doctest/doctest.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "../src/host_region.hpp"
+#include "../src/pool.hpp"
+
+TEST_CASE("warm restart") {
+  auto name = "/cuda_buddy_test_" + std::to_string(getpid());
+  cuda_buddy::host_region::remove(name);
+
+  cuda_buddy::pool::handle h{};
+  {
+    cuda_buddy::host_region region(name, 2, false);
+    REQUIRE(!region.restored());
+    cuda_buddy::pool buddy_pool(region);
+    REQUIRE(buddy_pool.full());
+
+    h = buddy_pool.alloc_handle(64);
+    REQUIRE(h != cuda_buddy::pool::handle::null);
+    std::strcpy(static_cast<char *>(buddy_pool.get_pointer(h)), "hello");
+    REQUIRE(buddy_pool.alloc(1ULL << cuda_buddy::pool::buddy_block_level));
+    REQUIRE(!buddy_pool.alloc(1ULL << cuda_buddy::pool::buddy_block_level));
+  }
+
+  {
+    cuda_buddy::host_region region(name, 2, false);
+    REQUIRE(region.restored());
+    cuda_buddy::pool buddy_pool(region);
+    REQUIRE(!buddy_pool.full());
+    REQUIRE(std::strcmp(static_cast<char *>(buddy_pool.get_pointer(h)),
+                        "hello") == 0);
+    REQUIRE(!buddy_pool.alloc(1ULL << cuda_buddy::pool::buddy_block_level));
+    REQUIRE(buddy_pool.free(h));
+    REQUIRE(!buddy_pool.free(h));
+    REQUIRE(buddy_pool.alloc(1ULL << cuda_buddy::pool::buddy_block_level));
+  }
+
+  //塊數不同，佈局不匹配
+  REQUIRE(!cuda_buddy::host_region::open(name, 3, false));
+  REQUIRE(cuda_buddy::host_region::open(name, 2, false));
+  REQUIRE(cuda_buddy::host_region::remove(name));
+}
+
+TEST_CASE("multi-process") {
+  auto name = "/cuda_buddy_test_mp_" + std::to_string(getpid());
+  cuda_buddy::host_region::remove(name);
+  cuda_buddy::host_region region(name, 1, false);
+  cuda_buddy::pool buddy_pool(region);
+
+  int fds[2];
+  REQUIRE(pipe(fds) == 0);
+  auto child = fork();
+  REQUIRE(child >= 0);
+  if (child == 0) {
+    int res = 0;
+    {
+      cuda_buddy::host_region child_region(name, 1, false);
+      cuda_buddy::pool child_pool(child_region);
+      for (int i = 0; i < 1000; i++) {
+        auto ptr = child_pool.alloc(64);
+        if (!ptr) {
+          res = 1;
+          break;
+        }
+        std::memset(ptr, 'c', 64);
+      }
+      auto ptr = static_cast<char *>(child_pool.alloc(64));
+      if (ptr) {
+        std::strcpy(ptr, "from child");
+        auto offset = child_region.offset_of(ptr);
+        if (write(fds[1], &offset, sizeof(offset)) != sizeof(offset)) {
+          res = 1;
+        }
+      }
+    }
+    _exit(res);
+  }
+
+  std::vector<void *> ptrs;
+  for (int i = 0; i < 1000; i++) {
+    auto ptr = buddy_pool.alloc(64);
+    REQUIRE(ptr);
+    std::memset(ptr, 'p', 64);
+    ptrs.push_back(ptr);
+  }
+  size_t offset = 0;
+  REQUIRE(read(fds[0], &offset, sizeof(offset)) == sizeof(offset));
+  int status = 0;
+  REQUIRE(waitpid(child, &status, 0) == child);
+  REQUIRE(WIFEXITED(status));
+  REQUIRE(WEXITSTATUS(status) == 0);
+  close(fds[0]);
+  close(fds[1]);
+
+  for (auto ptr : ptrs) {
+    REQUIRE(static_cast<char *>(ptr)[63] == 'p');
+    REQUIRE(buddy_pool.free(ptr));
+  }
+  auto ptr = region.address_of(offset);
+  REQUIRE(std::strcmp(static_cast<char *>(ptr), "from child") == 0);
+  REQUIRE(buddy_pool.free(ptr));
+  REQUIRE(!buddy_pool.full());
+  REQUIRE(cuda_buddy::host_region::remove(name));
+}
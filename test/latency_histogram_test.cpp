@@ -0,0 +1,76 @@
+#include <doctest/doctest.h>
+#include <initializer_list>
+#include <thread>
+
+#include "../src/latency_histogram.hpp"
+#include "../src/pool.hpp"
+
+using cuda_buddy::latency_histogram;
+
+TEST_CASE("buckets") {
+  for (uint64_t value : std::initializer_list<uint64_t>{
+           0, 1, 31, 32, 33, 1000, 123456789, UINT64_MAX}) {
+    auto index = latency_histogram::bucket_index(value);
+    REQUIRE(index < latency_histogram::bucket_num);
+    REQUIRE(latency_histogram::bucket_lower_bound(index) <= value);
+    REQUIRE(latency_histogram::bucket_upper_bound(index) >= value);
+    // 相對誤差不超過1/32
+    REQUIRE(latency_histogram::bucket_upper_bound(index) -
+                latency_histogram::bucket_lower_bound(index) <=
+            value / latency_histogram::sub_bucket_num);
+  }
+}
+
+#ifndef CUDA_BUDDY_DISABLE_LATENCY_HISTOGRAM
+TEST_CASE("percentiles") {
+  latency_histogram::enable();
+  latency_histogram::reset();
+  auto op = latency_histogram::operation::pool_free;
+  std::thread t([op]() {
+    for (uint64_t i = 1; i <= 1000; i++) {
+      latency_histogram::record(op, i * 1000);
+    }
+  });
+  t.join();
+  auto histogram = latency_histogram::get(op);
+  REQUIRE(histogram.count == 1000);
+  CHECK(histogram.min_ns <= 1000);
+  CHECK(histogram.min_ns >= 1000 - 1000 / 32);
+  CHECK(histogram.max_ns >= 1000000);
+  CHECK(histogram.mean_ns() == doctest::Approx(500500));
+  auto p50 = histogram.value_at_percentile(50);
+  CHECK(p50 >= 500000);
+  CHECK(p50 <= 500000 + 500000 / 32);
+  auto p99 = histogram.value_at_percentile(99);
+  CHECK(p99 >= 990000);
+  CHECK(p99 <= 990000 + 990000 / 32);
+  CHECK(histogram.value_at_percentile(100) == histogram.max_ns);
+
+  latency_histogram::reset();
+  REQUIRE(latency_histogram::get(op).count == 0);
+  latency_histogram::disable();
+}
+
+TEST_CASE("pool operations") {
+  cuda_buddy::pool::set_host_pool_size(cuda_buddy::pool::buddy_block_level);
+  latency_histogram::enable();
+  latency_histogram::reset();
+  {
+    cuda_buddy::pool buddy_pool(-1);
+    auto ptr = buddy_pool.alloc(100);
+    REQUIRE(ptr);
+    REQUIRE(buddy_pool.free(ptr));
+  }
+  latency_histogram::disable();
+  cuda_buddy::pool::release_global_pool(-1);
+
+  CHECK(latency_histogram::get(latency_histogram::operation::pool_alloc)
+            .count == 1);
+  CHECK(latency_histogram::get(latency_histogram::operation::pool_free)
+            .count == 1);
+  CHECK(latency_histogram::get(latency_histogram::operation::allocator_alloc)
+            .count >= 1);
+  CHECK(latency_histogram::get(latency_histogram::operation::get_block)
+            .count == 1);
+}
+#endif
@@ -0,0 +1,67 @@
+#include <doctest/doctest.h>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+
+#include "../src/lock_stats.hpp"
+#include "../src/pool.hpp"
+
+using cuda_buddy::lock_stats;
+
+#ifndef CUDA_BUDDY_DISABLE_LOCK_STATS
+TEST_CASE("contention") {
+  lock_stats::enable();
+  cuda_buddy::instrumented_mutex<std::shared_timed_mutex> mutex;
+  {
+    std::lock_guard lk(mutex);
+  }
+  auto stats = mutex.statistics();
+  REQUIRE(stats.acquire_count == 1);
+  REQUIRE(stats.contended_count == 0);
+  REQUIRE(stats.exclusive_count == 1);
+
+  {
+    std::unique_lock lk(mutex);
+    std::thread t([&mutex]() { std::shared_lock shared_lk(mutex); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    lk.unlock();
+    t.join();
+  }
+  stats = mutex.statistics();
+  CHECK(stats.acquire_count == 3);
+  CHECK(stats.contended_count == 1);
+  CHECK(stats.wait_ns > 0);
+  CHECK(stats.max_wait_ns == stats.wait_ns);
+  CHECK(stats.exclusive_count == 2);
+  CHECK(stats.hold_ns >= stats.wait_ns);
+
+  mutex.reset_statistics();
+  CHECK(mutex.statistics().acquire_count == 0);
+  lock_stats::disable();
+  {
+    std::lock_guard lk(mutex);
+  }
+  CHECK(mutex.statistics().acquire_count == 0);
+}
+
+TEST_CASE("pool locks") {
+  cuda_buddy::pool::set_host_pool_size(cuda_buddy::pool::buddy_block_level);
+  lock_stats::enable();
+  {
+    cuda_buddy::pool buddy_pool(-1);
+    auto ptr = buddy_pool.alloc(100);
+    REQUIRE(ptr);
+    REQUIRE(buddy_pool.free(ptr));
+
+    auto stats = buddy_pool.get_lock_statistics();
+    //分配和釋放遍歷塊的快照，只有取得新塊時加pool的鎖
+    CHECK(stats.local_pool.acquire_count >= 2);
+    CHECK(stats.global_pool.acquire_count >= 1);
+    REQUIRE(stats.block_ids.size() == 1);
+    REQUIRE(stats.blocks.size() == 1);
+    CHECK(stats.blocks[0].exclusive_count == 2);
+  }
+  lock_stats::disable();
+  cuda_buddy::pool::release_global_pool(-1);
+}
+#endif
@@ -1,16 +1,40 @@
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
 #include <cuda_runtime.h>
 #include <cuda_runtime_api.h>
 #include <mutex>
+#include <set>
 #include <spdlog/spdlog.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
 
 #include <doctest/doctest.h>
+#include <filesystem>
+#include <fstream>
+#include <string>
 #include <thread>
+#include <unistd.h>
 
 #include "../src/pool.hpp"
 
 namespace {
   auto logger = spdlog::stdout_color_mt("cuda_buddy");
+
+  struct alloc_task {
+    struct promise_type {
+      alloc_task get_return_object() { return {}; }
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() {}
+      void unhandled_exception() {}
+    };
+  };
+
+  alloc_task async_alloc(cuda_buddy::pool &buddy_pool, size_t size,
+                         void *&ptr) {
+    ptr = co_await buddy_pool.alloc_async(size);
+  }
+
   void real_test(int gpu_no) {
 
     {
@@ -59,6 +83,350 @@ namespace {
         }
         CHECK(buddy_pool.full());
       }
+
+      SUBCASE("capacity queries") {
+        cuda_buddy::pool buddy_pool(gpu_no);
+        constexpr size_t block_size = 1ULL
+                                      << cuda_buddy::pool::buddy_block_level;
+        REQUIRE(buddy_pool.largest_free() == block_size);
+        REQUIRE(buddy_pool.can_alloc(block_size, 1));
+        REQUIRE(!buddy_pool.can_alloc(block_size + 1, 1));
+
+        auto free_bytes = buddy_pool.free_bytes();
+        auto ptr = buddy_pool.alloc(block_size / 2);
+        REQUIRE(ptr);
+        REQUIRE(buddy_pool.free_bytes() == free_bytes - block_size / 2);
+        REQUIRE(buddy_pool.used_bytes() == block_size / 2);
+        REQUIRE(buddy_pool.live_count() == 1);
+        REQUIRE(!buddy_pool.full());
+        //另一個線程釋放，分片的計數總和仍然正確
+        std::thread([&buddy_pool, ptr]() {
+          REQUIRE(buddy_pool.free(ptr));
+        }).join();
+        REQUIRE(buddy_pool.free_bytes() == free_bytes);
+        REQUIRE(buddy_pool.used_bytes() == 0);
+        REQUIRE(buddy_pool.live_count() == 0);
+        REQUIRE(buddy_pool.full());
+      }
+
+      SUBCASE("occupancy") {
+        cuda_buddy::pool buddy_pool(gpu_no);
+        constexpr size_t block_size = 1ULL
+                                      << cuda_buddy::pool::buddy_block_level;
+        auto ptr = buddy_pool.alloc(block_size / 2);
+        REQUIRE(ptr);
+
+        auto map = buddy_pool.occupancy(256);
+        REQUIRE(map.resolution == 256);
+        REQUIRE(map.local_block_num == 1);
+        REQUIRE(map.cells.size() == map.block_ids.size() * 256);
+        REQUIRE(std::count(map.cells.begin(), map.cells.begin() + 256, 255) ==
+                128);
+        REQUIRE(std::count(map.cells.begin(), map.cells.end(), 0) ==
+                map.cells.size() - 128);
+
+        auto path = std::filesystem::temp_directory_path() /
+                    ("cuda_buddy_occupancy_" + std::to_string(getpid()) +
+                     ".pgm");
+        REQUIRE(buddy_pool.write_occupancy(path.string(), 256));
+        std::ifstream in(path, std::ios::binary);
+        std::string magic;
+        in >> magic;
+        REQUIRE(magic == "P5");
+        REQUIRE(std::filesystem::file_size(path) > map.cells.size());
+        std::filesystem::remove(path);
+        REQUIRE(buddy_pool.free(ptr));
+      }
+
+      SUBCASE("adaptive split") {
+        cuda_buddy::pool buddy_pool(gpu_no);
+        constexpr size_t block_size = 1ULL
+                                      << cuda_buddy::pool::buddy_block_level;
+        buddy_pool.set_adaptive_split(true, 8);
+        std::vector<void *> ptrs;
+        for (size_t i = 0; i < 4 + 1; i++) {
+          auto ptr = buddy_pool.alloc(block_size / 4);
+          REQUIRE(ptr);
+          ptrs.push_back(ptr);
+        }
+        //第二個塊取得時已經按學到的大小切分
+        auto map = buddy_pool.occupancy(4);
+        REQUIRE(map.local_block_num == 2);
+        REQUIRE(std::count(map.cells.begin() + 4, map.cells.begin() + 8,
+                           255) == 1);
+        for (auto ptr : ptrs) {
+          REQUIRE(buddy_pool.free(ptr));
+        }
+        CHECK(buddy_pool.full());
+        //保留的節點不妨礙整塊的分配
+        REQUIRE(buddy_pool.largest_free() == block_size);
+        auto ptr = buddy_pool.alloc(block_size);
+        REQUIRE(ptr);
+        REQUIRE(buddy_pool.free(ptr));
+      }
+
+      SUBCASE("best fit") {
+        cuda_buddy::pool buddy_pool(gpu_no);
+        buddy_pool.set_fit_policy(cuda_buddy::fit_policy::best_fit);
+        std::vector<void *> ptrs;
+        for (auto size : {4u, 2u, 1u, 1u}) {
+          auto ptr = buddy_pool.alloc(size);
+          REQUIRE(ptr);
+          ptrs.push_back(ptr);
+        }
+        REQUIRE(static_cast<uint8_t *>(ptrs[1]) -
+                    static_cast<uint8_t *>(ptrs[0]) ==
+                4);
+        for (auto ptr : ptrs) {
+          REQUIRE(buddy_pool.free(ptr));
+        }
+        CHECK(buddy_pool.full());
+      }
+
+      SUBCASE("lazy coalescing") {
+        cuda_buddy::pool buddy_pool(gpu_no);
+        buddy_pool.set_lazy_coalescing(4);
+        void *first_ptr = nullptr;
+        for (int i = 0; i < 10; i++) {
+          auto ptr = buddy_pool.alloc(1000);
+          REQUIRE(ptr);
+          if (!first_ptr) {
+            first_ptr = ptr;
+          }
+          REQUIRE(ptr == first_ptr);
+          REQUIRE(buddy_pool.free(ptr));
+        }
+        CHECK(buddy_pool.full());
+      }
+
+      SUBCASE("block affinity") {
+        cuda_buddy::pool buddy_pool(gpu_no);
+        buddy_pool.set_block_affinity(true);
+        constexpr size_t block_size = 1ULL
+                                      << cuda_buddy::pool::buddy_block_level;
+        auto first_ptr = buddy_pool.alloc(block_size);
+        auto second_ptr = buddy_pool.alloc(block_size);
+        REQUIRE(first_ptr);
+        REQUIRE(second_ptr);
+        REQUIRE(buddy_pool.free(first_ptr));
+        REQUIRE(buddy_pool.free(second_ptr));
+        //其他pool的分配不影響這個pool的起點
+        {
+          cuda_buddy::pool other_pool(gpu_no);
+          other_pool.set_block_affinity(true);
+          auto other_ptr = other_pool.alloc(1);
+          REQUIRE(other_ptr);
+          REQUIRE(other_pool.free(other_ptr));
+        }
+        //從上次成功的第二個塊開始找
+        auto ptr = buddy_pool.alloc(1);
+        REQUIRE(ptr == second_ptr);
+        REQUIRE(buddy_pool.free(ptr));
+        buddy_pool.set_block_affinity(false);
+        ptr = buddy_pool.alloc(1);
+        REQUIRE(ptr == first_ptr);
+        REQUIRE(buddy_pool.free(ptr));
+        CHECK(buddy_pool.full());
+      }
+
+      SUBCASE("automatic lock policy") {
+        cuda_buddy::pool buddy_pool(gpu_no);
+        auto ptr = buddy_pool.alloc(100);
+        REQUIRE(ptr);
+        //只有一個線程時不加鎖
+        CHECK(buddy_pool.locking() == cuda_buddy::lock_policy::none);
+        std::thread thd([&buddy_pool]() {
+          auto thread_ptr = buddy_pool.alloc(64);
+          REQUIRE(thread_ptr);
+          REQUIRE(buddy_pool.free(thread_ptr));
+        });
+        thd.join();
+        CHECK(buddy_pool.locking() == cuda_buddy::lock_policy::futex);
+        buddy_pool.set_lock_stripes(8);
+        CHECK(buddy_pool.locking() == cuda_buddy::lock_policy::shared);
+        buddy_pool.set_lock_stripes(0);
+        CHECK(buddy_pool.locking() == cuda_buddy::lock_policy::futex);
+        REQUIRE(buddy_pool.free(ptr));
+        CHECK(buddy_pool.full());
+      }
+
+      SUBCASE("lock policy") {
+        cuda_buddy::pool buddy_pool(gpu_no);
+        buddy_pool.set_lock_policy(cuda_buddy::lock_policy::none);
+        auto ptr = buddy_pool.alloc(100);
+        REQUIRE(ptr);
+        //切換時等正在使用的塊空閒，已有的分配不受影響
+        buddy_pool.set_lock_policy(cuda_buddy::lock_policy::futex);
+        CHECK(buddy_pool.locking() == cuda_buddy::lock_policy::futex);
+        std::vector<std::thread> thds;
+        for (int i = 0; i < 2; i++) {
+          thds.emplace_back([&buddy_pool]() {
+            for (int j = 0; j < 100; j++) {
+              auto thread_ptr = buddy_pool.alloc(64);
+              REQUIRE(thread_ptr);
+              REQUIRE(buddy_pool.free(thread_ptr));
+            }
+          });
+        }
+        for (auto &thd : thds) {
+          thd.join();
+        }
+        REQUIRE(buddy_pool.free(ptr));
+        CHECK(buddy_pool.full());
+      }
+
+      SUBCASE("tlsf engine") {
+        cuda_buddy::pool buddy_pool(gpu_no, cuda_buddy::block_engine::tlsf);
+        std::vector<void *> ptrs;
+        for (auto size : {1000u, 3000u, 5000u}) {
+          auto ptr = buddy_pool.alloc(size);
+          REQUIRE(ptr);
+          ptrs.push_back(ptr);
+        }
+        //只按256字節取整
+        REQUIRE(buddy_pool.used_bytes() == 1024 + 3072 + 5120);
+        REQUIRE(buddy_pool.alloc_handle(1) == cuda_buddy::pool::handle::null);
+        for (auto ptr : ptrs) {
+          REQUIRE(buddy_pool.free(ptr));
+        }
+        CHECK(buddy_pool.full());
+      }
+
+      SUBCASE("reservation") {
+        cuda_buddy::pool buddy_pool(gpu_no);
+        constexpr size_t block_size = 1ULL
+                                      << cuda_buddy::pool::buddy_block_level;
+        REQUIRE(!buddy_pool.reserve(block_size * 4 + 1));
+
+        void *ptr = nullptr;
+        {
+          auto res = buddy_pool.reserve(block_size + block_size / 2);
+          REQUIRE(res);
+          REQUIRE(buddy_pool.free_bytes() == block_size * 2);
+          ptr = res->alloc(block_size / 2);
+          REQUIRE(ptr);
+          auto ptr2 = res->alloc(block_size / 4);
+          REQUIRE(ptr2);
+          auto ptr3 = res->alloc(block_size / 2);
+          REQUIRE(ptr3);
+          auto ptr4 = res->alloc(block_size / 4);
+          REQUIRE(ptr4);
+          REQUIRE(res->remaining() == 0);
+          REQUIRE(!res->alloc(1));
+          REQUIRE(res->free(ptr2));
+          REQUIRE(!buddy_pool.free(ptr2));
+          //釋放不加回預留量
+          REQUIRE(!res->alloc(1));
+          REQUIRE(res->free(ptr3));
+          REQUIRE(res->free(ptr4));
+        }
+        REQUIRE(buddy_pool.free(ptr));
+
+        {
+          //移動賦值覆蓋的預留把塊歸還給pool
+          auto first = buddy_pool.reserve(1);
+          auto second = buddy_pool.reserve(1);
+          REQUIRE(first);
+          REQUIRE(second);
+          ptr = first->alloc(1);
+          REQUIRE(ptr);
+          *first = std::move(*second);
+          REQUIRE(first->remaining() == 1);
+          REQUIRE(second->remaining() == 0);
+          REQUIRE(buddy_pool.free(ptr));
+        }
+        //所有預留析構後整個預算都還能用
+        REQUIRE(buddy_pool.free_bytes() == block_size * 4);
+        std::vector<void *> ptrs;
+        for (int i = 0; i < 4; i++) {
+          auto block_ptr = buddy_pool.alloc(block_size);
+          REQUIRE(block_ptr);
+          ptrs.push_back(block_ptr);
+        }
+        for (auto block_ptr : ptrs) {
+          REQUIRE(buddy_pool.free(block_ptr));
+        }
+      }
+
+      SUBCASE("handle") {
+        cuda_buddy::pool buddy_pool(gpu_no);
+        std::vector<cuda_buddy::pool::handle> handles;
+        for (auto size : {4u, 2u, 1u, 1u}) {
+          auto h = buddy_pool.alloc_handle(size);
+          REQUIRE(h != cuda_buddy::pool::handle::null);
+          REQUIRE(buddy_pool.get_pointer(h));
+          handles.push_back(h);
+        }
+        REQUIRE(static_cast<uint8_t *>(buddy_pool.get_pointer(handles[1])) -
+                    static_cast<uint8_t *>(buddy_pool.get_pointer(handles[0])) ==
+                4);
+        //越界的節點下標
+        auto bad_handle = static_cast<cuda_buddy::pool::handle>(
+            (static_cast<uint64_t>(handles[0]) & ~uint64_t(UINT32_MAX)) |
+            (UINT32_MAX - 1));
+        REQUIRE(!buddy_pool.get_pointer(bad_handle));
+        for (auto h : handles) {
+          REQUIRE(buddy_pool.free(h));
+          REQUIRE(!buddy_pool.free(h));
+        }
+        CHECK(buddy_pool.full());
+      }
+
+      SUBCASE("block id reuse") {
+        std::set<uint64_t> block_ids;
+        for (int i = 0; i < 8; i++) {
+          {
+            cuda_buddy::pool buddy_pool(gpu_no);
+            auto h = buddy_pool.alloc_handle(1);
+            REQUIRE(h != cuda_buddy::pool::handle::null);
+            block_ids.insert(static_cast<uint64_t>(h) >> 32);
+            REQUIRE(buddy_pool.free(h));
+          }
+          cuda_buddy::pool::release_global_pool(gpu_no);
+        }
+        //銷毀的塊的id被重用
+        CHECK(block_ids.size() <= 4);
+      }
+
+      SUBCASE("wait for memory") {
+        cuda_buddy::pool buddy_pool(gpu_no);
+        constexpr size_t block_size = 1ULL
+                                      << cuda_buddy::pool::buddy_block_level;
+        std::vector<void *> ptrs;
+        for (int i = 0; i < 4; i++) {
+          auto ptr = buddy_pool.alloc(block_size);
+          REQUIRE(ptr);
+          ptrs.push_back(ptr);
+        }
+        REQUIRE(!buddy_pool.alloc_wait(1, std::chrono::milliseconds(10)));
+
+        void *waited_ptr = nullptr;
+        std::thread waiter([&]() {
+          waited_ptr = buddy_pool.alloc_wait(block_size, std::chrono::hours(1));
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        REQUIRE(buddy_pool.free(ptrs.back()));
+        waiter.join();
+        REQUIRE(waited_ptr == ptrs.back());
+        ptrs.back() = waited_ptr;
+
+        void *first_ptr = nullptr;
+        void *second_ptr = nullptr;
+        async_alloc(buddy_pool, block_size, first_ptr);
+        async_alloc(buddy_pool, 1, second_ptr);
+        REQUIRE(!first_ptr);
+        REQUIRE(!second_ptr);
+
+        REQUIRE(buddy_pool.free(ptrs[0]));
+        REQUIRE(first_ptr == ptrs[0]);
+        REQUIRE(!second_ptr);
+        REQUIRE(buddy_pool.free(ptrs[1]));
+        REQUIRE(second_ptr == ptrs[1]);
+        REQUIRE(buddy_pool.free(first_ptr));
+        REQUIRE(buddy_pool.free(second_ptr));
+        REQUIRE(buddy_pool.free(ptrs[2]));
+        REQUIRE(buddy_pool.free(ptrs[3]));
+      }
     }
 
     cuda_buddy::pool::release_global_pool(gpu_no);
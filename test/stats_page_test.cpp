@@ -0,0 +1,84 @@
+#include <doctest/doctest.h>
+#include <fcntl.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../src/pool.hpp"
+#include "../src/stats_page.hpp"
+
+namespace {
+  auto logger = spdlog::stdout_color_mt("cuda_buddy");
+}
+
+TEST_CASE("stats page") {
+  cuda_buddy::pool::set_host_pool_size(cuda_buddy::pool::buddy_block_level +
+                                       2);
+  auto name = "/cuda_buddy_stats_test_" + std::to_string(getpid());
+  cuda_buddy::pool buddy_pool(-1);
+  {
+    cuda_buddy::stats_page page(name, std::chrono::milliseconds(10));
+    REQUIRE(page.add_pool(buddy_pool));
+    //不頂替已有的同名頁
+    REQUIRE(!cuda_buddy::stats_page::open(name, std::chrono::milliseconds(10)));
+
+    auto ptr = buddy_pool.alloc(1000);
+    REQUIRE(ptr);
+    REQUIRE(!buddy_pool.alloc(1ULL << 40));
+    page.publish();
+
+    auto stats = cuda_buddy::stats_page::read(name);
+    REQUIRE(stats);
+    REQUIRE(stats->size() == 1);
+    CHECK(stats->front().gpu_no == -1);
+    CHECK(stats->front().used_bytes == 1024);
+    CHECK(stats->front().block_num == 1);
+    CHECK(stats->front().alloc_count == 1);
+    CHECK(stats->front().free_count == 0);
+    CHECK(stats->front().failure_count == 1);
+
+    REQUIRE(buddy_pool.free(ptr));
+    // 後台線程會定期寫入
+    for (int i = 0; i < 100; i++) {
+      stats = cuda_buddy::stats_page::read(name);
+      if (stats && stats->front().free_count == 1) {
+        break;
+      }
+      usleep(10000);
+    }
+    CHECK(stats->front().free_count == 1);
+    CHECK(stats->front().used_bytes == 0);
+
+    REQUIRE(page.remove_pool(buddy_pool));
+    REQUIRE(!page.remove_pool(buddy_pool));
+    stats = cuda_buddy::stats_page::read(name);
+    REQUIRE(stats);
+    CHECK(stats->empty());
+  }
+  CHECK(!cuda_buddy::stats_page::read(name));
+
+  //崩潰的進程留下的頁刪除後可以重新創建
+  auto page = cuda_buddy::stats_page::open(name, std::chrono::milliseconds(10));
+  REQUIRE(page);
+  REQUIRE(cuda_buddy::stats_page::read(name));
+  {
+    //模擬寫者停在寫槽的中途，讀者不會一直等
+    auto fd = shm_open(name.c_str(), O_RDWR, 0);
+    REQUIRE(fd >= 0);
+    auto ptr = mmap(nullptr, 128, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    REQUIRE(ptr != MAP_FAILED);
+    auto sequence = reinterpret_cast<uint64_t *>(static_cast<uint8_t *>(ptr) +
+                                                 64);
+    *sequence = 1;
+    CHECK(!cuda_buddy::stats_page::read(name));
+    *sequence = 2;
+    CHECK(cuda_buddy::stats_page::read(name));
+    munmap(ptr, 128);
+  }
+  REQUIRE(cuda_buddy::stats_page::remove(name));
+  REQUIRE(!cuda_buddy::stats_page::remove(name));
+  page.reset();
+}
@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <doctest/doctest.h>
+#include <map>
+#include <random>
+#include <vector>
+
+#include "../src/tlsf.hpp"
+
+TEST_CASE("tlsf") {
+  constexpr size_t size = 1 << 16;
+  std::vector<uint8_t> buffer(size);
+  cuda_buddy::tlsf engine(buffer.data(), size);
+  REQUIRE(engine.largest_free() == size);
+
+  SUBCASE("alloc and free") {
+    size_t alloced_size = 0;
+    auto ptr = engine.alloc(1000, 1, alloced_size);
+    REQUIRE(ptr == buffer.data());
+    REQUIRE(alloced_size == 1024);
+    auto ptr2 = engine.alloc(300, 1, alloced_size);
+    REQUIRE(static_cast<uint8_t *>(ptr2) - buffer.data() == 1024);
+    REQUIRE(alloced_size == 512);
+    REQUIRE(engine.used_bytes() == 1536);
+    REQUIRE(engine.largest_free() == size - 1536);
+    REQUIRE(!engine.alloc(size, 1, alloced_size));
+
+    size_t freed_size = 0;
+    REQUIRE(engine.free(ptr, freed_size));
+    REQUIRE(freed_size == 1024);
+    REQUIRE(!engine.free(ptr, freed_size));
+    auto ptr3 = engine.alloc(1024, 1, alloced_size);
+    REQUIRE(ptr3 == ptr);
+    REQUIRE(engine.free(ptr3, freed_size));
+    REQUIRE(engine.free(ptr2, freed_size));
+    REQUIRE(engine.used_bytes() == 0);
+    REQUIRE(engine.largest_free() == size);
+  }
+
+  SUBCASE("alignment") {
+    size_t alloced_size = 0;
+    auto ptr = engine.alloc(100, 1000, alloced_size);
+    REQUIRE(ptr);
+    REQUIRE(reinterpret_cast<uintptr_t>(ptr) % 1000 == 0);
+    size_t freed_size = 0;
+    //只接受返回的指針
+    REQUIRE(!engine.free(static_cast<uint8_t *>(ptr) + 1, freed_size));
+    REQUIRE(!engine.free(buffer.data() + size, freed_size));
+    REQUIRE(engine.free(ptr, freed_size));
+    REQUIRE(freed_size == alloced_size);
+  }
+
+  SUBCASE("occupancy") {
+    size_t alloced_size = 0;
+    auto ptr = engine.alloc(size / 4 + size / 8, 1, alloced_size);
+    REQUIRE(ptr);
+    std::vector<uint8_t> expected{255, 128, 0, 0};
+    REQUIRE(engine.occupancy(4) == expected);
+  }
+
+  SUBCASE("random") {
+    std::mt19937 rng(0);
+    std::map<uint8_t *, size_t> live;
+    size_t alloced_size = 0;
+    size_t freed_size = 0;
+    for (int i = 0; i < 10000; i++) {
+      if (live.empty() || rng() % 2 == 0) {
+        auto ptr = static_cast<uint8_t *>(
+            engine.alloc(rng() % 4096 + 1, 1, alloced_size));
+        if (!ptr) {
+          continue;
+        }
+        auto it = live.emplace(ptr, alloced_size).first;
+        if (it != live.begin()) {
+          REQUIRE(std::prev(it)->first + std::prev(it)->second <= ptr);
+        }
+        if (std::next(it) != live.end()) {
+          REQUIRE(ptr + alloced_size <= std::next(it)->first);
+        }
+      } else {
+        auto it = std::next(live.begin(), rng() % live.size());
+        REQUIRE(engine.free(it->first, freed_size));
+        REQUIRE(freed_size == it->second);
+        live.erase(it);
+      }
+    }
+    for (auto const &[ptr, _] : live) {
+      REQUIRE(engine.free(ptr, freed_size));
+    }
+    REQUIRE(engine.largest_free() == size);
+  }
+}
@@ -0,0 +1,38 @@
+#include <doctest/doctest.h>
+#include <sstream>
+
+#include "../src/pool.hpp"
+#include "../src/tracer.hpp"
+
+TEST_CASE("chrome trace") {
+  cuda_buddy::pool::set_host_pool_size(cuda_buddy::pool::buddy_block_level);
+  cuda_buddy::tracer::start();
+  {
+    cuda_buddy::pool buddy_pool(-1);
+    auto ptr = buddy_pool.alloc(100);
+    REQUIRE(ptr);
+    REQUIRE(buddy_pool.used_bytes() == 128);
+    REQUIRE(buddy_pool.free(ptr));
+    REQUIRE(buddy_pool.used_bytes() == 0);
+  }
+  cuda_buddy::tracer::stop();
+  cuda_buddy::pool::release_global_pool(-1);
+
+  std::ostringstream os;
+  cuda_buddy::tracer::write_chrome_trace(os);
+  auto trace = os.str();
+  CHECK(trace.find("\"name\":\"alloc\"") != std::string::npos);
+  CHECK(trace.find("\"size\":100") != std::string::npos);
+  CHECK(trace.find("\"name\":\"free\"") != std::string::npos);
+  CHECK(trace.find("\"name\":\"get_block\"") != std::string::npos);
+  CHECK(trace.find("\"name\":\"release\"") != std::string::npos);
+  CHECK(trace.find("\"name\":\"sync_stream\"") != std::string::npos);
+  CHECK(trace.find("\"ph\":\"C\"") != std::string::npos);
+  CHECK(trace.find("\"name\":\"host\"") != std::string::npos);
+
+  cuda_buddy::tracer::start(1);
+  std::ostringstream empty_os;
+  cuda_buddy::tracer::write_chrome_trace(empty_os);
+  CHECK(empty_os.str() == "{\"traceEvents\":[]}\n");
+  cuda_buddy::tracer::stop();
+}